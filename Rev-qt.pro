@@ -222,6 +222,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
     src/blocksizecalculator.h \
+    src/orphanblocks.h \
+    src/msgscheduler.h \
+    src/relaycache.h \
+    src/socketevents.h \
     src/allocators.h \
     src/addrman.h \
     src/base58.h \
@@ -230,6 +234,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/fork.h \
@@ -366,6 +371,10 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
     src/blocksizecalculator.cpp \
+    src/orphanblocks.cpp \
+    src/msgscheduler.cpp \
+    src/relaycache.cpp \
+    src/socketevents.cpp \
     src/allocators.cpp \
     src/base58.cpp \
     src/blockparams.cpp \
@@ -5,17 +5,120 @@
 
 #include "blocksizecalculator.h"
 
+#include <cmath>
+#include <deque>
+#include <set>
+
 using namespace BlockSizeCalculator;
 using namespace std;
 
-static std::vector<unsigned int> blocksizes;
-static bool sorted = false;
+/** Sizes of the last nWindow blocks of a chain and their median.
+ *
+ * The sizes are split over two multisets, the smaller half (plus the middle
+ * element when the count is odd) in setLow and the rest in setHigh, so the
+ * median is read off their boundary and every update is O(log n). The window
+ * remembers the block it ends at: moving it one block forward slides it,
+ * anything else (a reorganization, or a block checked off the best chain)
+ * rebuilds it by walking pprev, which always reflects the chain the block is
+ * on. Sizes are kept in the block index once read from the block files.
+ */
+class CBlockSizeWindow
+{
+private:
+    unsigned int nWindow;
+    const CBlockIndex* pindexTip;
+    std::deque<unsigned int> dequeSizes; // chain order, oldest first
+    std::multiset<unsigned int> setLow;
+    std::multiset<unsigned int> setHigh;
+
+    void Rebalance()
+    {
+        while (setLow.size() > setHigh.size() + 1)
+        {
+            std::multiset<unsigned int>::iterator it = --setLow.end();
+            setHigh.insert(*it);
+            setLow.erase(it);
+        }
+        while (setHigh.size() > setLow.size())
+        {
+            std::multiset<unsigned int>::iterator it = setHigh.begin();
+            setLow.insert(*it);
+            setHigh.erase(it);
+        }
+    }
+
+    void Insert(unsigned int nSize)
+    {
+        if (setLow.empty() || nSize <= *setLow.rbegin())
+            setLow.insert(nSize);
+        else
+            setHigh.insert(nSize);
+        Rebalance();
+    }
+
+    void Erase(unsigned int nSize)
+    {
+        if (!setLow.empty() && nSize <= *setLow.rbegin())
+            setLow.erase(setLow.find(nSize));
+        else
+            setHigh.erase(setHigh.find(nSize));
+        Rebalance();
+    }
+
+public:
+    CBlockSizeWindow(unsigned int nWindowIn) : nWindow(nWindowIn), pindexTip(NULL) {}
+
+    /** Make the window end at pindex. Returns false if the chain below it
+     *  has fewer than nWindow blocks. */
+    bool SetTip(CBlockIndex* pindex)
+    {
+        if (pindex != pindexTip)
+        {
+            if (pindexTip != NULL && pindex->pprev == pindexTip && dequeSizes.size() == nWindow)
+            {
+                unsigned int nSize = BlockSizeCalculator::GetBlockSize(pindex);
+                dequeSizes.push_back(nSize);
+                Insert(nSize);
+                Erase(dequeSizes.front());
+                dequeSizes.pop_front();
+            }
+            else
+            {
+                dequeSizes.clear();
+                setLow.clear();
+                setHigh.clear();
+                for (CBlockIndex* pindexWalk = pindex; pindexWalk != NULL && dequeSizes.size() < nWindow; pindexWalk = pindexWalk->pprev)
+                {
+                    unsigned int nSize = BlockSizeCalculator::GetBlockSize(pindexWalk);
+                    dequeSizes.push_front(nSize);
+                    Insert(nSize);
+                }
+            }
+            pindexTip = pindex;
+        }
+        return dequeSizes.size() == nWindow;
+    }
+
+    unsigned int GetMedian() const
+    {
+        if (setLow.empty())
+            return 0;
+        if (setLow.size() > setHigh.size())
+            return *setLow.rbegin();
+        return static_cast<unsigned int>(floor((*setLow.rbegin() + *setHigh.begin()) / 2.0));
+    }
+};
 
 unsigned int BlockSizeCalculator::ComputeBlockSize(CBlockIndex *pblockindex, unsigned int pastblocks) {
 
 	unsigned int proposedMaxBlockSize = 0;
     unsigned int result = MIN_BLOCK_SIZE;
 
+	// Until the toggle block the limit stays at MIN_BLOCK_SIZE
+	if (pblockindex->nHeight < MEDIAN_BLOCK_SIZE_TOGGLE) {
+		return result;
+	}
+
 	LOCK(cs_main);
 
 	proposedMaxBlockSize = ::GetMedianBlockSize(pblockindex, pastblocks);
@@ -35,97 +138,39 @@ unsigned int BlockSizeCalculator::ComputeBlockSize(CBlockIndex *pblockindex, uns
 
 }
 
-inline unsigned int BlockSizeCalculator::GetMedianBlockSize(
+unsigned int BlockSizeCalculator::GetMedianBlockSize(
 		CBlockIndex *pblockindex, unsigned int pastblocks) {
 
-	blocksizes = ::GetBlockSizes(pblockindex, pastblocks);
-
-	if(!sorted) {
-		std::sort(blocksizes.begin(), blocksizes.end());
-		sorted = true;
-	}
+	AssertLockHeld(cs_main);
 
-	unsigned int vsize = blocksizes.size();
-	if (vsize == pastblocks) {
-		double median = 0;
-		if ((vsize % 2) == 0) {
-			median = (blocksizes[vsize / 2] + blocksizes[(vsize / 2) - 1]) / 2.0;
-		} else {
-			median = blocksizes[vsize / 2];
-		}
-		return static_cast<unsigned int>(floor(median));
-	} else {
+	if (pblockindex->nHeight < (int)pastblocks) {
 		return 0;
 	}
 
-}
-
-inline std::vector<unsigned int> BlockSizeCalculator::GetBlockSizes(
-		CBlockIndex *pblockindex, unsigned int pastblocks) {
-
-	if (pblockindex->nHeight < (int)pastblocks) {
-		return blocksizes;
+	static CBlockSizeWindow window(NUM_BLOCKS_FOR_MEDIAN_BLOCK);
+	if (pastblocks != NUM_BLOCKS_FOR_MEDIAN_BLOCK) {
+		CBlockSizeWindow windowOther(pastblocks);
+		return windowOther.SetTip(pblockindex) ? windowOther.GetMedian() : 0;
 	}
-
-	int firstBlock = pblockindex->nHeight - pastblocks;
-
-	if (blocksizes.size() > 0) {
-
-		int latestBlockSize = ::GetBlockSize(pblockindex);
-
-		if (latestBlockSize != -1) {
-
-			CBlockIndex *firstBlockIndex = FindBlockByHeight(firstBlock);
-			int oldestBlockSize = ::GetBlockSize(firstBlockIndex);
-			if (oldestBlockSize != -1) {
-				std::vector<unsigned int>::iterator it;
-				it = std::find(blocksizes.begin(), blocksizes.end(),
-						oldestBlockSize);
-				if (it != blocksizes.end()) {
-					blocksizes.erase(it);
-					it = std::lower_bound(blocksizes.begin(), blocksizes.end(),
-							latestBlockSize);
-					blocksizes.insert(it, latestBlockSize);
-				}
-			}
-
-		}
-
-	} else {
-
-		while (pblockindex != NULL && pblockindex->nHeight > firstBlock) {
-
-			int blocksize = ::GetBlockSize(pblockindex);
-			if (blocksize != -1) {
-
-				blocksizes.push_back(blocksize);
-			}
-
-			pblockindex = pblockindex->pprev;
-		}
-
-	}
-
-	return blocksizes;
+	return window.SetTip(pblockindex) ? window.GetMedian() : 0;
 
 }
 
-inline int BlockSizeCalculator::GetBlockSize(CBlockIndex *pblockindex) {
-
-	if (pblockindex == NULL) {
-		return -1;
+unsigned int BlockSizeCalculator::GetBlockSize(CBlockIndex *pblockindex) {
+
+	if (pblockindex->nBlockSize == 0) {
+		// Entries loaded from the block index: read the size prefix stored
+		// in front of the block, once.
+		CAutoFile filein(OpenBlockFile(pblockindex->nFile, pblockindex->nBlockPos - sizeof(uint32_t), "rb"), SER_DISK, CLIENT_VERSION);
+		uint32_t size = 0;
+		try {
+			if (!!filein)
+				filein >> size;
+		} catch (std::exception &e) {
+			size = 0;
+		}
+		pblockindex->nBlockSize = size;
 	}
-
-	const CDiskBlockPos& pos = pblockindex->GetBlockPos();
-
-	CAutoFile filein(OpenBlockFile(pos, false), SER_DISK, CLIENT_VERSION);
-	FILE* blockFile = filein.release();
-	long int filePos = ftell(blockFile);
-	fseek(blockFile, filePos - sizeof(uint32_t), SEEK_SET);
-
-	uint32_t size = 0;
-	fread(&size, sizeof(uint32_t), 1, blockFile);
-	fclose(blockFile);
-	return (unsigned int) size;
+	return pblockindex->nBlockSize;
 
 }
@@ -18,8 +18,7 @@ using namespace std;
 
 namespace BlockSizeCalculator {
     unsigned int ComputeBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline unsigned int GetMedianBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline std::vector<unsigned int> GetBlockSizes(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline int GetBlockSize(CBlockIndex*);
+    unsigned int GetMedianBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
+    unsigned int GetBlockSize(CBlockIndex*);
 }
-#endif
\ No newline at end of file
+#endif
@@ -11,9 +11,20 @@
 
 #include <stdio.h>
 
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
 class CScript;
 class CTransaction;
 
+/** Block hashes are uniformly distributed, so a 64-bit slice of one is
+ * already a good hash table key. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
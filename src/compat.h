@@ -36,6 +36,9 @@
 #include <limits.h>
 #include <netdb.h>
 #include <unistd.h>
+#ifdef __linux__
+#define USE_EPOLL 1
+#endif
 #endif
 
 #ifdef WIN32
@@ -14,6 +14,8 @@ static const int64_t nReservePhaseStart = 10;
 static const int64_t VELOCITY_TOGGLE = 175; // Implementation of the Velocity system into the chain.
 /** Velocity retarget toggle block */
 static const int64_t VELOCITY_TDIFF = 0; // Use Velocity's retargetting method.
+/** Median block size toggle block */
+static const int64_t MEDIAN_BLOCK_SIZE_TOGGLE = 0x7fffffff; // Not scheduled, blocks stay limited to MIN_BLOCK_SIZE.
 /** Protocol 3.0 toggle */
 inline bool IsProtocolV3(int64_t nTime) { return TestNet() || nTime > 1493596800; } // Mon, 01 May 2017 00:00:00 GMT
 #endif // BITCOIN_FORK_H
@@ -11,6 +11,8 @@
 #include "txdb.h"
 #include "rpcserver.h"
 #include "net.h"
+#include "orphanblocks.h"
+#include "relaycache.h"
 #include "key.h"
 #include "pubkey.h"
 #include "util.h"
@@ -126,12 +128,20 @@ void Shutdown()
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
     DumpMasternodes();
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", true))
+        DumpMempool();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (pindexBest && GetBoolArg("-blockindexsnapshot", false))
+        {
+            CTxDB txdb("r");
+            txdb.WriteBlockIndexSnapshot();
+        }
+        orphanBlocks.Clear();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -195,7 +205,11 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n";
+    strUsage += "  -sigcachesize=<n>      " + strprintf(_("Limit the signature cache to <n> megabytes (default: %u, 0 = off)"), (unsigned int)DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -209,6 +223,11 @@ std::string HelpMessage()
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or Tor)") + "\n";
     strUsage += "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n";
     strUsage += "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n";
+#ifdef USE_EPOLL
+    strUsage += "  -epoll                 " + _("Wait for network sockets with epoll rather than select() (default: 1)") + "\n";
+#endif
+    strUsage += "  -relaycachesize=<n>    " + strprintf(_("Keep up to <n> megabytes of recently requested blocks and transactions ready to send (default: %u)"), DEFAULT_RELAY_CACHE_SIZE) + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + strprintf(_("Number of threads to handle peer messages with (1-%d, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS) + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n";
     strUsage += "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n";
     strUsage += "  -forcednsseed          " + _("Always query for peer addresses via DNS lookup (default: 0)") + "\n";
@@ -267,9 +286,14 @@ std::string HelpMessage()
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
+    strUsage += "  -blockindexsnapshot    " + _("Save the block index to a snapshot file on shutdown and load it from there on the next start (default: 0)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
-    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocksmem=<n> " + strprintf(_("Keep at most <n> megabytes of unconnectable blocks in memory, spilling the rest to disk (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY) + "\n";
+    strUsage += "  -maxorphanblocksdisk=<n> " + strprintf(_("Spill at most <n> megabytes of unconnectable blocks to disk (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_DISK) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> kilobytes of transactions with missing inputs in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TX_SIZE) + "\n";
+    strUsage += "  -headersfirst          " + _("Download block headers first and fetch the blocks from all peers in parallel (default: 0)") + "\n";
     strUsage += "  -backtoblock=<n>      " + _("Rollback local block chain to block height <n>") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -470,6 +494,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Check for -debugnet (deprecated)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
+    // Check for -maxsigcachesize (deprecated), it counted entries rather than megabytes
+    if (mapArgs.count("-maxsigcachesize"))
+    {
+        int64_t nEntries = std::max(GetArg("-maxsigcachesize", 0), (int64_t)0);
+        int64_t nMegabytes = (nEntries * (int64_t)sizeof(uint256) + (1 << 20) - 1) >> 20;
+        if (SoftSetArg("-sigcachesize", i64tostr(nMegabytes)))
+            InitWarning(strprintf(_("Warning: Deprecated argument -maxsigcachesize=%d (entries) taken as -sigcachesize=%d (megabytes)"), nEntries, nMegabytes));
+        else
+            InitWarning(_("Warning: Deprecated argument -maxsigcachesize ignored, use -sigcachesize"));
+    }
     // Check for -socks - as this is a privacy risk to continue, exit here
     if (mapArgs.count("-socks"))
         return InitError(_("Error: Unsupported argument -socks found. Setting SOCKS version isn't possible anymore, only SOCKS5 proxies are supported."));
@@ -502,6 +536,20 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 #endif
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    orphanBlocks.SetLimits(std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS)),
+                           std::max((int64_t)0, GetArg("-maxorphanblocksmem", DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY)) * 1000000,
+                           std::max((int64_t)0, GetArg("-maxorphanblocksdisk", DEFAULT_MAX_ORPHAN_BLOCKS_DISK)) * 1000000);
+    relayCache.SetMaxBytes(std::max((int64_t)0, GetArg("-relaycachesize", DEFAULT_RELAY_CACHE_SIZE)) * 1000000);
+
     fConfChange = GetBoolArg("-confchange", false);
 
 #ifdef ENABLE_WALLET
@@ -549,6 +597,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("Used data directory %s\n", strDataDir);
     std::ostringstream strErrors;
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     if (mapArgs.count("-masternodepaymentskey")) // masternode payments priv key
     {
         if (!masternodePayments.SetPrivKey(GetArg("-masternodepaymentskey", "")))
@@ -835,7 +889,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1166,7 +1220,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 	    bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
 	    CBlock pblockAddr;
 	    if(pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	        pblockAddr.RebuildAddressIndex(txdbAddr);
+	        pblockAddr.RebuildAddressIndex(txdbAddr, pblockAddrIndex->nHeight);
 	    pblockAddrIndex = pblockAddrIndex->pprev;
 	}
     }
@@ -229,7 +229,12 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 //
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    return CheckStakeKernelHash(pindexPrev, nBits, nTimeBlockFrom, txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -237,7 +242,6 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -252,7 +256,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     CDataStream ss(SER_GETHASH, 0);
 
     ss << bnStakeModifierV2;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash_echo512(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -263,7 +267,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -280,7 +284,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -329,27 +333,114 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx)
         return (nTimeBlock == nTimeTx) && ((nTimeTx & STAKE_TIMESTAMP_MASK) == 0);
 }
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+// Reads what CheckKernel() needs about prevout as of pindexPrev
+static CStakeCandidate ReadStakeCandidate(CTxDB& txdb, const CBlockIndex* pindexPrev, const COutPoint& prevout)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-
-    CTxDB txdb("r");
+    CStakeCandidate candidate;
     CTransaction txPrev;
     CTxIndex txindex;
     if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
-        return false;
+        return candidate;
 
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return false;
+        return candidate;
 
-   int nDepth;
-   if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
-       return false;
+    int nDepth;
+    if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
+        return candidate;
+
+    candidate.fEligible = true;
+    candidate.nTimeBlockFrom = block.GetBlockTime();
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    return candidate;
+}
+
+CStakeCache stakeCache;
+
+CStakeCandidate CStakeCache::Get(CTxDB& txdb, const CBlockIndex* pindexPrev, const COutPoint& prevout)
+{
+    LOCK(cs);
+    if (pindexPrev->GetBlockHash() != hashTip)
+    {
+        mapCandidates.clear();
+        hashTip = pindexPrev->GetBlockHash();
+    }
+
+    map<COutPoint, CStakeCandidate>::iterator mi = mapCandidates.find(prevout);
+    if (mi != mapCandidates.end())
+        return mi->second;
+
+    CStakeCandidate candidate = ReadStakeCandidate(txdb, pindexPrev, prevout);
+    mapCandidates.insert(make_pair(prevout, candidate));
+    return candidate;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+{
+    CTxDB txdb("r");
+    CStakeCandidate candidate = ReadStakeCandidate(txdb, pindexPrev, prevout);
+    if (!candidate.fEligible)
+        return false;
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = candidate.nTimeBlockFrom;
+
+    return CheckKernel(pindexPrev, nBits, nTime, prevout, candidate);
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeCandidate& candidate)
+{
+    uint256 hashProofOfStake, targetProofOfStake;
+    if (!candidate.fEligible)
+        return false;
+    return CheckStakeKernelHash(pindexPrev, nBits, candidate.nTimeBlockFrom, candidate.nTimeTxPrev, candidate.nValue, prevout, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+bool FindKernel(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeStart, unsigned int nCount, unsigned int nStep, const COutPoint& prevout, const CStakeCandidate& candidate, unsigned int& nTimeTxRet)
+{
+    if (!candidate.fEligible || nCount == 0)
+        return false;
+
+    // Weighted target, as in CheckStakeKernelHash()
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(candidate.nValue);
+    bool fAnyHash = bnTarget.bitSize() > 256;
+    uint256 hashTarget = fAnyHash ? 0 : bnTarget.getuint256();
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    // Absorb everything in front of the timestamp once
+    CDataStream ss(SER_GETHASH, 0);
+    ss << pindexPrev->bnStakeModifierV2;
+    ss << candidate.nTimeTxPrev << prevout.hash << prevout.n;
+    sph_echo512_context ctxPrefix;
+    sph_echo512_init(&ctxPrefix);
+    sph_echo512(&ctxPrefix, &ss[0], ss.size());
+
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        if ((int64_t)nTimeStart - (int64_t)i * nStep < candidate.nTimeTxPrev)
+            break; // CheckStakeKernelHash() nTime violation, only older from here on
+        unsigned int nTimeTx = nTimeStart - i * nStep;
+
+        unsigned char vchTime[4];
+        vchTime[0] = nTimeTx;
+        vchTime[1] = nTimeTx >> 8;
+        vchTime[2] = nTimeTx >> 16;
+        vchTime[3] = nTimeTx >> 24;
+
+        sph_echo512_context ctx = ctxPrefix;
+        uint512 hash;
+        sph_echo512(&ctx, vchTime, sizeof(vchTime));
+        sph_echo512_close(&ctx, &hash);
+
+        if (fAnyHash || hash.trim256() <= hashTarget)
+        {
+            nTimeTxRet = nTimeTx;
+            return true;
+        }
+    }
+    return false;
 }
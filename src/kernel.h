@@ -6,6 +6,8 @@
 
 #include "main.h"
 
+class CTxDB;
+
 // To decrease granularity of timestamp
 // Supposed to be 2^n-1
 static const int STAKE_TIMESTAMP_MASK = 15;
@@ -22,6 +24,7 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -38,4 +41,41 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// What the kernel search needs to know about a staking coin besides the
+// timestamp. It only changes with the chain tip.
+struct CStakeCandidate
+{
+    bool fEligible; // in the main chain and deep enough to stake
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+
+    CStakeCandidate() : fEligible(false), nTimeBlockFrom(0), nTimeTxPrev(0), nValue(0) {}
+};
+
+// Stake candidates read for the current tip, so that searching a coin over
+// many timestamps and many rounds touches the disk once per tip
+class CStakeCache
+{
+private:
+    CCriticalSection cs;
+    uint256 hashTip;
+    std::map<COutPoint, CStakeCandidate> mapCandidates;
+
+public:
+    // Returns the candidate for prevout as of pindexPrev, reading it on a
+    // miss. Everything cached for an earlier tip is dropped first.
+    CStakeCandidate Get(CTxDB& txdb, const CBlockIndex* pindexPrev, const COutPoint& prevout);
+};
+
+extern CStakeCache stakeCache;
+
+// CheckKernel() with the coin already looked up
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeCandidate& candidate);
+
+// CheckKernel() over nCount timestamps nTimeStart, nTimeStart - nStep, ...
+// The part of the kernel that does not depend on the timestamp is hashed
+// once. Sets nTimeTxRet to the first (latest) timestamp meeting the target.
+bool FindKernel(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeStart, unsigned int nCount, unsigned int nStep, const COutPoint& prevout, const CStakeCandidate& candidate, unsigned int& nTimeTxRet);
+
 #endif // PPCOIN_KERNEL_H
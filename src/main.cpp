@@ -11,10 +11,13 @@
 #include "blockparams.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
 #include "net.h"
+#include "orphanblocks.h"
+#include "relaycache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -49,7 +52,7 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -58,26 +61,29 @@ uint256 nBestChainTrust = 0;
 uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
+std::atomic<bool> fMempoolLoaded(false);
 bool fReindex = false;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
 bool fRollingCheckpoint = false;
+int nScriptCheckThreads = 0;
 std::string GetRelayPeerAddr= "127.0.0.1";
 
-struct COrphanBlock {
-    uint256 hashBlock;
-    uint256 hashPrev;
-    std::pair<COutPoint, unsigned int> stake;
-    vector<unsigned char> vchBlock;
-};
-map<uint256, COrphanBlock*> mapOrphanBlocks;
-multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
-set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+COrphanBlockStore orphanBlocks;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+struct COrphanTx {
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+map<NodeId, uint64_t> mapOrphanTxSizeByPeer;
+uint64_t nOrphanTxSize = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -106,6 +112,28 @@ struct QueuedBlock {
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+// Headers-first sync. Checked headers of blocks we do not have yet, and the
+// chain of them from the block index up to the best header, along which
+// blocks are fetched from all peers that have them. Headers are only taken
+// in answer to our own getheaders, at most MAX_HEADERS_AHEAD of them.
+// Protected by cs_main.
+struct CHeaderEntry {
+    uint256 hashPrev;
+    int nHeight;
+    int64_t nTime;
+    uint256 nChainTrust; // as CBlockIndex::nChainTrust, as far as it can be checked
+};
+map<uint256, CHeaderEntry> mapHeaders;
+uint256 hashBestHeader = 0;
+int nBestHeaderHeight = -1;
+uint256 nBestHeaderTrust = 0;
+// vHeaderChain[i] is the header at height nHeaderChainStart + i; the first
+// one is the first block of the chain that is not in the block index
+deque<uint256> vHeaderChain;
+int nHeaderChainStart = 0;
+// When a block of the header chain last made it into the block index
+int64_t nHeaderChainProgress = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -200,6 +228,16 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // The best block of the header chain, or the block index, that this
+    // peer is known to have, from its headers, invs and blocks.
+    uint256 hashBestKnown;
+    int nBestKnownHeight;
+    // The last block it announced that we did not know yet.
+    uint256 hashLastUnknownBlock;
+    // When our outstanding getheaders was sent to this peer, or 0.
+    int64_t nHeadersRequestTime;
+    // Whether the last headers message was full, so the peer has more.
+    bool fMoreHeaders;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -208,10 +246,15 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        hashBestKnown = 0;
+        nBestKnownHeight = -1;
+        hashLastUnknownBlock = 0;
+        nHeadersRequestTime = 0;
+        fMoreHeaders = false;
     }
 };
 
-map<NodeId, CNodeState> mapNodeState;
+map<NodeId, CNodeState> mapNodeState GUARDED_BY(cs_main);
 
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
@@ -244,6 +287,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload)
         mapBlocksToDownload.erase(hash);
+    EraseOrphansFor(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -303,6 +347,225 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main.
+// Median time of the 11 blocks ending at hash, looking through the headers
+// of headers-first sync first and the block index after.
+int64_t GetHeaderMedianTimePast(uint256 hash) {
+    vector<int64_t> vTimes;
+    map<uint256, CHeaderEntry>::iterator it;
+    while (vTimes.size() < 11 && (it = mapHeaders.find(hash)) != mapHeaders.end()) {
+        vTimes.push_back(it->second.nTime);
+        hash = it->second.hashPrev;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        for (const CBlockIndex* pindex = mi->second; pindex && vTimes.size() < 11; pindex = pindex->pprev)
+            vTimes.push_back(pindex->GetBlockTime());
+    if (vTimes.empty())
+        return 0;
+    sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size() / 2];
+}
+
+// Requires cs_main.
+// Lays out the chain from the block index to the best header again, after
+// the best header moved to another branch, and forgets the headers off it.
+void RebuildHeaderChain() {
+    vHeaderChain.clear();
+    for (map<uint256, CHeaderEntry>::iterator it = mapHeaders.find(hashBestHeader); it != mapHeaders.end(); it = mapHeaders.find(it->second.hashPrev)) {
+        vHeaderChain.push_front(it->first);
+        nHeaderChainStart = it->second.nHeight;
+    }
+    if (mapHeaders.size() > vHeaderChain.size()) {
+        set<uint256> setChain(vHeaderChain.begin(), vHeaderChain.end());
+        for (map<uint256, CHeaderEntry>::iterator it = mapHeaders.begin(); it != mapHeaders.end(); ) {
+            if (setChain.count(it->first))
+                ++it;
+            else
+                mapHeaders.erase(it++);
+        }
+    }
+}
+
+// Requires cs_main.
+void ClearHeaders() {
+    mapHeaders.clear();
+    vHeaderChain.clear();
+    hashBestHeader = 0;
+    nBestHeaderHeight = -1;
+    nBestHeaderTrust = 0;
+}
+
+// Requires cs_main.
+// Checks a header received in headers-first sync and files it in mapHeaders.
+// Only what a header carries can be checked: that it links up, its
+// timestamp, that its target is within the limits and the checkpoints.
+// Whether a block is proof-of-work or proof-of-stake is only known from its
+// transactions, so the proof itself is checked when the block arrives and
+// goes through ProcessBlock() like any other; only below StartPoSBlock(),
+// where it can be nothing but proof-of-work, is the hash checked here.
+//
+// Above that, nBits is whatever the sender claims, so such headers are
+// ranked by the least trust any valid block has, not by their nBits. This
+// only bounds what a peer can claim: it can still send a long run of made
+// up proof-of-stake headers, and they lead the download until
+// HEADERS_STALE_TIMEOUT drops them. That is why -headersfirst is off by
+// default.
+bool AcceptHeader(const CBlock& header, int& nHeightRet) {
+    uint256 hash = header.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end()) {
+        nHeightRet = mi->second->nHeight;
+        return true;
+    }
+    map<uint256, CHeaderEntry>::iterator it = mapHeaders.find(hash);
+    if (it != mapHeaders.end()) {
+        nHeightRet = it->second.nHeight;
+        return true;
+    }
+
+    int nHeight;
+    uint256 nPrevTrust;
+    BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
+    map<uint256, CHeaderEntry>::iterator itPrev = mapHeaders.find(header.hashPrevBlock);
+    if (miPrev != mapBlockIndex.end()) {
+        nHeight = miPrev->second->nHeight + 1;
+        nPrevTrust = miPrev->second->nChainTrust;
+    } else if (itPrev != mapHeaders.end()) {
+        nHeight = itPrev->second.nHeight + 1;
+        nPrevTrust = itPrev->second.nChainTrust;
+    } else
+        return error("AcceptHeader() : header %s does not connect", hash.ToString());
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptHeader() : header %s has a timestamp too far in the future", hash.ToString());
+    if (header.GetBlockTime() <= GetHeaderMedianTimePast(header.hashPrevBlock))
+        return header.DoS(100, error("AcceptHeader() : header %s has a timestamp too early", hash.ToString()));
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (bnTarget <= 0 || bnTarget > std::max(Params().ProofOfWorkLimit(), Params().ProofOfStakeLimit()))
+        return header.DoS(100, error("AcceptHeader() : header %s has nBits below minimum work", hash.ToString()));
+    if (nHeight < Params().StartPoSBlock() && !CheckProofOfWork(hash, header.nBits))
+        return header.DoS(50, error("AcceptHeader() : header %s has proof of work failed", hash.ToString()));
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return header.DoS(100, error("AcceptHeader() : header %s at height %d rejected by checkpoint", hash.ToString(), nHeight));
+    if (!Checkpoints::CheckSync(nHeight))
+        return error("AcceptHeader() : header %s at height %d forks below the synchronized checkpoint", hash.ToString(), nHeight);
+
+    if (mapHeaders.empty())
+        nHeaderChainProgress = GetTime();
+    CHeaderEntry& entry = mapHeaders[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeight;
+    entry.nTime = header.GetBlockTime();
+    if (nHeight < Params().StartPoSBlock())
+        entry.nChainTrust = nPrevTrust + GetBlockTrust(header.nBits);
+    else
+        entry.nChainTrust = nPrevTrust + GetBlockTrust(std::max(Params().ProofOfWorkLimit(), Params().ProofOfStakeLimit()).GetCompact());
+
+    // The best header is the one with the most trust, as for the block
+    // chain itself, and only worth fetching if it beats our best block
+    if (entry.nChainTrust > std::max(nBestHeaderTrust, nBestChainTrust)) {
+        hashBestHeader = hash;
+        nBestHeaderHeight = nHeight;
+        nBestHeaderTrust = entry.nChainTrust;
+        if (vHeaderChain.empty() ? miPrev != mapBlockIndex.end() : vHeaderChain.back() == header.hashPrevBlock) {
+            if (vHeaderChain.empty())
+                nHeaderChainStart = nHeight;
+            vHeaderChain.push_back(hash);
+        } else
+            RebuildHeaderChain();
+    }
+    nHeightRet = nHeight;
+    return true;
+}
+
+// Requires cs_main.
+// Forgets the headers at the front of the header chain whose blocks made it
+// into the block index, without looking at the rest of mapHeaders.
+void TrimHeaderChain() {
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front())) {
+        mapHeaders.erase(vHeaderChain.front());
+        vHeaderChain.pop_front();
+        nHeaderChainStart++;
+        nHeaderChainProgress = GetTime();
+    }
+    if (vHeaderChain.empty() && !mapHeaders.empty())
+        ClearHeaders();
+}
+
+// Requires cs_main.
+// Remembers that a peer has the block hash, sent or announced by it.
+void UpdateBlockAvailability(NodeId nodeid, const uint256& hash) {
+    CNodeState *state = State(nodeid);
+    int nHeight;
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    map<uint256, CHeaderEntry>::iterator it = mapHeaders.find(hash);
+    if (mi != mapBlockIndex.end())
+        nHeight = mi->second->nHeight;
+    else if (it != mapHeaders.end())
+        nHeight = it->second.nHeight;
+    else {
+        state->hashLastUnknownBlock = hash;
+        return;
+    }
+    if (nHeight >= state->nBestKnownHeight) {
+        state->hashBestKnown = hash;
+        state->nBestKnownHeight = nHeight;
+    }
+    if (hash == state->hashLastUnknownBlock)
+        state->hashLastUnknownBlock = 0;
+}
+
+// Requires cs_main.
+// Queues blocks of the header chain for a peer that has them, from the
+// window of BLOCK_DOWNLOAD_WINDOW blocks at the front of the chain, up to
+// its share. A peer only has the blocks below the best one it is known to
+// have, and only if that one is on the header chain.
+void FindBlocksToDownload(CNode* pnode, CNodeState& state) {
+    if (state.hashLastUnknownBlock != 0)
+        UpdateBlockAvailability(pnode->GetId(), state.hashLastUnknownBlock);
+    int nKnown = state.nBestKnownHeight - nHeaderChainStart;
+    if (nKnown < 0 || nKnown >= (int)vHeaderChain.size() || vHeaderChain[nKnown] != state.hashBestKnown)
+        return;
+    int nEnd = std::min(nKnown + 1, BLOCK_DOWNLOAD_WINDOW);
+    for (int i = 0; i < nEnd; i++) {
+        if (state.nBlocksInFlight + state.nBlocksToDownload >= MAX_HEADERS_FIRST_BLOCKS_PER_PEER)
+            break;
+        const uint256& hash = vHeaderChain[i];
+        if (orphanBlocks.Has(hash))
+            continue;
+        AddBlockToQueue(pnode->GetId(), hash);
+    }
+}
+
+// Requires cs_main.
+// Every block in the window waits for the first one. A peer that has had
+// it in flight for BLOCK_STALLING_TIMEOUT while later blocks sit in the
+// orphan store is holding up the sync.
+bool IsStallingDownload(NodeId nodeid, int64_t nNow) {
+    if (vHeaderChain.empty())
+        return false;
+    const uint256& hash = vHeaderChain.front();
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(hash);
+    return (it != mapBlocksInFlight.end() && it->second.first == nodeid &&
+            it->second.second->nTime < nNow - BLOCK_STALLING_TIMEOUT * 1000000 &&
+            orphanBlocks.HasChildren(hash));
+}
+
+// Requires cs_main.
+void PushGetHeaders(CNode* pnode) {
+    CNodeState *state = State(pnode->GetId());
+    CBlockLocator locator(pindexBest);
+    if (!vHeaderChain.empty())
+        locator.PushFront(hashBestHeader);
+    state->nHeadersRequestTime = GetTime();
+    state->fMoreHeaders = false;
+    pnode->PushMessage("getheaders", locator, uint256(0));
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -348,7 +611,12 @@ bool AbortNode(const std::string &strMessage, const std::string &userMessage) {
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+static uint64_t GetMaxOrphanTxSize()
+{
+    return std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000;
+}
+
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -359,51 +627,115 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The byte budget bounds the whole pool; each peer gets a share of it
+    // so that one peer cannot crowd out the orphans of all the others.
 
-    size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    unsigned int nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
 
-    if (nSize > 5000)
+    if (nSize > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    map<NodeId, uint64_t>::const_iterator itPeer = mapOrphanTxSizeByPeer.find(peer);
+    uint64_t nPeerSize = (itPeer == mapOrphanTxSizeByPeer.end()) ? 0 : itPeer->second;
+    if (nPeerSize + nSize > GetMaxOrphanTxSize() / ORPHAN_TX_PEER_SHARE)
+    {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d is over its share\n", hash.ToString(), peer);
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = nSize;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    mapOrphanTxSizeByPeer[peer] += nSize;
+    nOrphanTxSize += nSize;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphanTransactions.size(), nOrphanTxSize);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    map<uint256, CTransaction>::iterator it = mapOrphanTransactions.find(hash);
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, uint64_t>::iterator itPeer = mapOrphanTxSizeByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTxSizeByPeer.end())
+    {
+        itPeer->second -= it->second.nTxSize;
+        if (itPeer->second == 0)
+            mapOrphanTxSizeByPeer.erase(itPeer);
+    }
+    nOrphanTxSize -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+void EraseOrphansFor(NodeId peer)
+{
+    if (!mapOrphanTxSizeByPeer.count(peer))
+        return;
+    unsigned int nErased = 0;
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin();
+    while (it != mapOrphanTransactions.end())
+    {
+        map<uint256, COrphanTx>::iterator itErase = it++;
+        if (itErase->second.fromPeer == peer)
+        {
+            EraseOrphanTx(itErase->first);
+            ++nErased;
+        }
+    }
+    LogPrint("mempool", "erased %u orphan tx from peer=%d\n", nErased, peer);
+}
+
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow)
+    {
+        // Sweep out expired orphans, at most once per ORPHAN_TX_EXPIRE_INTERVAL
+        int64_t nMinExpire = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin();
+        while (it != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator itErase = it++;
+            if (itErase->second.nTimeExpire <= nNow)
+            {
+                EraseOrphanTx(itErase->first);
+                ++nEvicted;
+            }
+            else
+                nMinExpire = std::min(itErase->second.nTimeExpire, nMinExpire);
+        }
+        // Sweep again an interval after the next orphan expires, so that
+        // the linear scan is done for a batch of them
+        nNextSweep = nMinExpire + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nEvicted > 0)
+            LogPrint("mempool", "erased %u expired orphan tx\n", nEvicted);
+    }
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxSize > nMaxBytes)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -422,7 +754,7 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, const uint256& hash, CTxIndex& txin
     SetNull();
     if (!txdb.ReadTxIndex(hash, txindexRet))
         return false;
-    if (!ReadFromDisk(txindexRet.pos))
+    if (!txdb.ReadTxFromDisk(hash, txindexRet.pos, *this))
         return false;
     return true;
 }
@@ -707,7 +1039,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -822,12 +1154,65 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fFixSpentCoins)
+// Script checks of connected blocks and of transactions entering the memory
+// pool share the verification threads. Whoever fills the queue holds
+// cs_scriptcheckqueue until it has its result; cs_main, if needed, is always
+// taken first.
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCriticalSection cs_scriptcheckqueue;
+
+static CCriticalSection cs_admissionStats;
+static CAdmissionStageStats admissionStats[ADMIT_STAGE_COUNT];
+
+void GetAdmissionStats(std::vector<CAdmissionStageStats>& vStats)
 {
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
+    LOCK(cs_admissionStats);
+    vStats.assign(admissionStats, admissionStats + ADMIT_STAGE_COUNT);
+}
+
+// Counts one pass through an admission stage, and the time it took, when it
+// goes out of scope; the pass is a rejection unless fPassed was set.
+class CAdmissionStageTimer
+{
+private:
+    int nStage;
+    int64_t nTimeStart;
+
+public:
+    bool fPassed;
+
+    CAdmissionStageTimer(int nStageIn) : nStage(nStageIn), nTimeStart(GetTimeMicros()), fPassed(false) {}
+
+    ~CAdmissionStageTimer()
+    {
+        int64_t nTime = GetTimeMicros() - nTimeStart;
+        LOCK(cs_admissionStats);
+        CAdmissionStageStats& stats = admissionStats[nStage];
+        stats.nCount++;
+        if (!fPassed)
+            stats.nRejected++;
+        stats.nTimeMicros += nTime;
+    }
+};
+
+// What the input stage of admission hands on to the script and insert stages
+struct CTxAdmission
+{
+    uint256 hash;
+    uint256 hashTip;
+    CTxMemPoolEntry entry;
+    std::vector<CScriptCheck> vChecks;
+    std::vector<CScriptCheck> vMandatoryChecks;
+    bool fFree; // to be counted against -limitfreerelay, see LimitFreeRelay()
+
+    CTxAdmission() : fFree(false) {}
+};
+
+// Checks that need nothing but the transaction itself, so transactions from
+// the network can be screened before cs_main is taken.
+static bool CheckTxForMempool(const CTransaction& tx)
+{
+    CAdmissionStageTimer timer(ADMIT_PRECHECK);
 
     if (!tx.CheckTransaction())
         return error("AcceptToMemoryPool : CheckTransaction failed");
@@ -840,29 +1225,26 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     if (tx.IsCoinStake())
         return tx.DoS(100, error("AcceptToMemoryPool : coinstake as individual tx"));
 
-    // Rather not work on nonstandard transactions (unless -testnet)
-    string reason;
-    if (!TestNet() && !IsStandardTx(tx, reason))
-        return error("AcceptToMemoryPool : nonstandard transaction: %s",
-                     reason);
+    timer.fPassed = true;
+    return true;
+}
 
-    // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
+// Whether tx can join the pool as it is now: not in it yet, and spending
+// nothing a pool transaction or an InstantX lock already spends.
+static bool CheckPoolConflicts(CTxMemPool& pool, const CTransaction& tx, const uint256& hash)
+{
+    AssertLockHeld(cs_main);
     if (pool.exists(hash))
         return false;
 
-    // ----------- instantX transaction scanning -----------
-
     BOOST_FOREACH(const CTxIn& in, tx.vin){
         if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return tx.DoS(0, error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason));
+            if(mapLockedInputs[in.prevout] != hash){
+                return tx.DoS(0, error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", hash.ToString()));
             }
         }
     }
 
-    // Check for conflicts with in-memory transactions
-    {
     LOCK(pool.cs); // protect pool.mapNextTx
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
@@ -873,8 +1255,59 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
             return false;
         }
     }
-    }
+    return true;
+}
 
+// Continuously rate-limit free transactions
+// This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+// be annoying or make others' transactions take longer to confirm.
+// Called once per transaction, however often its inputs are looked up.
+static bool LimitFreeRelay(unsigned int nSize)
+{
+    static CCriticalSection csFreeLimiter;
+    static double dFreeCount;
+    static int64_t nLastTime;
+    int64_t nNow = GetTime();
+
+    LOCK(csFreeLimiter);
+
+    // Use an exponentially decaying ~10-minute window:
+    dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
+    nLastTime = nNow;
+    // -limitfreerelay unit is thousand-bytes-per-minute
+    // At default rate it would take over a month to fill 1GB
+    if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000)
+        return error("AcceptToMemoryPool : free transaction rejected by rate limiter");
+    LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+    dFreeCount += nSize;
+    return true;
+}
+
+// Everything that needs the chain state: policy, inputs, fees and the cheap
+// part of ConnectInputs. With fDeferScripts the signature checks are left in
+// admission for VerifyTxScripts(), otherwise they are run here one by one.
+// Free transactions are only flagged in admission.fFree; the caller charges
+// them to LimitFreeRelay().
+static bool AcceptTxInputs(CTxMemPool& pool, CTransaction& tx, bool fLimitFree, bool* pfMissingInputs,
+                           bool fRejectInsaneFee, bool ignoreFees, CTxAdmission& admission, bool fDeferScripts)
+{
+    AssertLockHeld(cs_main);
+    CAdmissionStageTimer timer(ADMIT_INPUTS);
+
+    // Rather not work on nonstandard transactions (unless -testnet)
+    string reason;
+    if (!TestNet() && !IsStandardTx(tx, reason))
+        return error("AcceptToMemoryPool : nonstandard transaction: %s",
+                     reason);
+
+    uint256 hash = tx.GetHash();
+    if (!CheckPoolConflicts(pool, tx, hash))
+        return false;
+
+    admission = CTxAdmission();
+    admission.hash = hash;
+    admission.hashTip = hashBestChain;
+    CTxMemPoolEntry& entry = admission.entry;
     {
         CTxDB txdb("r");
 
@@ -933,28 +1366,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                             hash.ToString(),
                             nFees, txMinFee);
 
-            // Continuously rate-limit free transactions
-            // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-            // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nFees < MIN_RELAY_TX_FEE)
-            {
-                static CCriticalSection csFreeLimiter;
-                static double dFreeCount;
-                static int64_t nLastTime;
-                int64_t nNow = GetTime();
-
-                LOCK(csFreeLimiter);
-
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000)
-                    return error("AcceptableInputs : free transaction rejected by rate limiter");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-                dFreeCount += nSize;
-            }
+            // After evicting for -maxmempool, don't take back what was just
+            // evicted
+            int64_t nPoolMinFee = pool.GetMinFeePerKb() * nSize / 1000;
+            if (nFees < nPoolMinFee)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                            hash.ToString(),
+                            nFees, nPoolMinFee);
+
+            admission.fFree = (fLimitFree && nFees < MIN_RELAY_TX_FEE);
         }
 
         if (fRejectInsaneFee && nFees > MIN_RELAY_TX_FEE * 10000)
@@ -964,7 +1384,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS,
+                              true, fDeferScripts ? &admission.vChecks : NULL))
         {
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
         }
@@ -978,14 +1399,93 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS,
+                              true, fDeferScripts ? &admission.vMandatoryChecks : NULL))
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Keep what the block template needs, so it does not have to fetch
+        // the inputs again
+        entry.nFee = nFees;
+        entry.nTxSize = nSize;
+        entry.nSigOps = nSigOps;
+        entry.nTime = GetTime();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            int64_t nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            if (pool.exists(txin.prevout.hash))
+            {
+                entry.setDependsOn.insert(txin.prevout.hash);
+                continue;
+            }
+            int nDepth = txindex.GetDepthInMainChain();
+            if (nDepth > 0)
+            {
+                entry.nValueInChain += nValueIn;
+                entry.dValueHeightInChain += (double)nValueIn * (nBestHeight + 1 - nDepth);
+            }
+        }
+    }
+
+    timer.fPassed = true;
+    return true;
+}
+
+static bool RunScriptChecks(std::vector<CScriptCheck>& vChecks)
+{
+    if (!nScriptCheckThreads)
+    {
+        BOOST_FOREACH(const CScriptCheck& check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    LOCK(cs_scriptcheckqueue);
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+// The signature checks deferred by AcceptTxInputs(), on the script check
+// threads. Needs no lock: the checks own copies of the spent transactions.
+static bool VerifyTxScripts(CTxAdmission& admission)
+{
+    CAdmissionStageTimer timer(ADMIT_SCRIPTS);
+
+    // A failed check in the queue does not say which input failed or how
+    // badly. The queue takes the checks, so keep them to find the input and
+    // report it as ConnectInputs() would, DoS score included.
+    std::vector<CScriptCheck> vChecks(admission.vChecks);
+    if (!RunScriptChecks(admission.vChecks))
+    {
+        BOOST_FOREACH(const CScriptCheck& check, vChecks)
+            if (!check())
+                return check.ReportFailure();
+        return false;
     }
+    if (!RunScriptChecks(admission.vMandatoryChecks))
+        return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", admission.hash.ToString());
+
+    timer.fPassed = true;
+    return true;
+}
+
+static bool AddTxToMemoryPool(CTxMemPool& pool, CTransaction& tx, const CTxAdmission& admission, bool fFixSpentCoins)
+{
+    AssertLockHeld(cs_main);
+    CAdmissionStageTimer timer(ADMIT_INSERT);
+    const uint256& hash = admission.hash;
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, tx, admission.entry);
+
+    // Keep the pool within -maxmempool, evicting what pays the least
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full %s", hash.ToString());
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL, true, fFixSpentCoins);
@@ -994,59 +1494,85 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
            hash.ToString(),
            pool.mapTx.size());
 
+    timer.fPassed = true;
     return true;
 }
 
-bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
-                         bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fFixSpentCoins)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
-    CTransaction tx(txo);
-    string reason;
-
-    if (!tx.CheckTransaction())
-        return error("AcceptableInputs : CheckTransaction failed");
-
-    // Coinbase is only valid in a block, not as a loose transaction
-    if (tx.IsCoinBase())
-        return tx.DoS(100, error("AcceptableInputs : coinbase as individual tx"));
+    if (!CheckTxForMempool(tx))
+        return false;
 
-    // ppcoin: coinstake is also only valid in a block, not as a loose transaction
-    if (tx.IsCoinStake())
-        return tx.DoS(100, error("AcceptableInputs : coinstake as individual tx"));
+    CTxAdmission admission;
+    if (!AcceptTxInputs(pool, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees, admission, true))
+        return false;
+    if (admission.fFree && !LimitFreeRelay(admission.entry.nTxSize))
+        return false;
 
-    // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
-    if (pool.exists(hash))
+    if (!VerifyTxScripts(admission))
         return false;
 
-    // ----------- instantX transaction scanning -----------
+    return AddTxToMemoryPool(pool, tx, admission, fFixSpentCoins);
+}
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return tx.DoS(0, error("AcceptableInputs : conflicts with existing transaction lock: %s", reason));
-            }
-        }
-    }
+bool AcceptToMemoryPoolConcurrent(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                                  bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
 
-    // Check for conflicts with in-memory transactions
-    {
-    LOCK(pool.cs); // protect pool.mapNextTx
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    if (!CheckTxForMempool(tx))
+        return false;
+
+    CTxAdmission admission;
     {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (pool.mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
+        LOCK(cs_main);
+        if (!AcceptTxInputs(pool, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees, admission, true))
+            return false;
+        if (admission.fFree && !LimitFreeRelay(admission.entry.nTxSize))
             return false;
-        }
-    }
     }
 
+    if (!VerifyTxScripts(admission))
+        return false;
+
+    LOCK(cs_main);
+
+    // The inputs were looked up against a chain and pool that may have
+    // moved on while the scripts were checked. Look them up again if so,
+    // checking the scripts in place: the signatures are in the cache by now,
+    // and the transaction was counted against the free relay limit already.
+    bool fChanged = (admission.hashTip != hashBestChain || !CheckPoolConflicts(pool, tx, admission.hash));
+    BOOST_FOREACH(const uint256& hashDependsOn, admission.entry.setDependsOn)
+        fChanged |= !pool.exists(hashDependsOn);
+    if (fChanged && !AcceptTxInputs(pool, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees, admission, false))
+        return false;
+
+    return AddTxToMemoryPool(pool, tx, admission, false);
+}
+
+bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
+                         bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    CTransaction tx(txo);
+
+    if (!CheckTxForMempool(tx))
+        return false;
+
+    // not in the memory pool yet, and no conflicts with it or InstantX locks
+    uint256 hash = tx.GetHash();
+    if (!CheckPoolConflicts(pool, tx, hash))
+        return false;
+
     {
         CTxDB txdb("r");
 
@@ -1094,28 +1620,8 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
                             hash.ToString(),
                             nFees, txMinFee);
 
-            // Continuously rate-limit free transactions
-            // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-            // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nFees < MIN_RELAY_TX_FEE)
-            {
-                static CCriticalSection csFreeLimiter;
-                static double dFreeCount;
-                static int64_t nLastTime;
-                int64_t nNow = GetTime();
-
-                LOCK(csFreeLimiter);
-
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000)
-                    return error("AcceptableInputs : free transaction rejected by rate limiter");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-                dFreeCount += nSize;
-            }
+            if (fLimitFree && nFees < MIN_RELAY_TX_FEE && !LimitFreeRelay(nSize))
+                return false;
         }
 
         if (fRejectInsaneFee && nFees > txMinFee * 10000)
@@ -1147,7 +1653,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1313,7 +1819,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1369,22 +1875,25 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1401,56 +1910,6 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
-uint256 static GetOrphanRoot(const uint256& hash)
-{
-    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
-    if (it == mapOrphanBlocks.end())
-        return hash;
-
-    // Work back to the first block in the orphan chain
-    do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
-        if (it2 == mapOrphanBlocks.end())
-            return it->first;
-        it = it2;
-    } while(true);
-}
-
-// ppcoin: find block wanted by given orphan block
-uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
-{
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrev))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrev];
-    return pblockOrphan->hashPrev;
-}
-
-// Remove a random orphan block (which does not have any dependent orphans).
-void static PruneOrphanBlocks()
-{
-    if (mapOrphanBlocksByPrev.size() <= (size_t)std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS)))
-        return;
-
-    // Pick a random orphan block.
-    int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-    std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
-    while (pos--) it++;
-
-    // As long as this block has other orphans depending on it, move to one of those successors.
-    do {
-        std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
-        if (it2 == mapOrphanBlocksByPrev.end())
-            break;
-        it = it2;
-    } while(1);
-
-    setStakeSeenOrphan.erase(it->second->stake);
-    uint256 hash = it->second->hashBlock;
-    delete it->second;
-    mapOrphanBlocksByPrev.erase(it);
-    mapOrphanBlocks.erase(hash);
-}
-
 // ppcoin: find last block index up to pindex
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
 {
@@ -1615,7 +2074,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         else
         {
             // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            if (!txdb.ReadTxFromDisk(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
         }
     }
@@ -1666,8 +2125,32 @@ int64_t CTransaction::GetValueMapIn(const MapPrevTx& inputs) const
 
 }
 
+// Report an input whose signature check failed. The same failure is
+// reported whether the check ran serially or on the script check queue.
+static bool InputScriptFailed(const CTransaction& txPrev, const CTransaction& txTo, unsigned int nIn, unsigned int flags)
+{
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-null dummy arguments;
+        // if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        if (VerifySignature(txPrev, txTo, nIn, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", txTo.GetHash().ToString());
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return txTo.DoS(100,error("ConnectInputs() : %s VerifySignature failed", txTo.GetHash().ToString()));
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1711,6 +2194,9 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        map<uint256, boost::shared_ptr<const CTransaction> > mapCheckPrev;
+        if (pvChecks)
+            pvChecks->reserve(pvChecks->size() + vin.size());
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1731,28 +2217,20 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (!(fBlock && !IsInitialBlockDownload()))
                 {
-                    // Verify signature
-                    if (!VerifySignature(txPrev, *this, i, flags, 0))
+                    if (pvChecks)
                     {
-                        if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                            // Check whether the failure was caused by a
-                            // non-mandatory script verification check, such as
-                            // non-null dummy arguments;
-                            // if so, don't trigger DoS protection to
-                            // avoid splitting the network between upgraded and
-                            // non-upgraded nodes.
-                            if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
-                                return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
-                        }
-                        // Failures of other flags indicate a transaction that is
-                        // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                        // such nodes as they are not following the protocol. That
-                        // said during an upgrade careful thought should be taken
-                        // as to the correct behavior - we may want to continue
-                        // peering with non-upgraded nodes even after a soft-fork
-                        // super-majority vote has passed.
-                        return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+                        // Defer the signature check to the script check queue;
+                        // the caller is responsible for waiting on the result.
+                        boost::shared_ptr<const CTransaction>& ptxPrev = mapCheckPrev[prevout.hash];
+                        if (!ptxPrev)
+                            ptxPrev.reset(new CTransaction(txPrev));
+                        pvChecks->push_back(CScriptCheck());
+                        CScriptCheck check(ptxPrev, *this, i, flags, 0);
+                        check.swap(pvChecks->back());
                     }
+                    // Verify signature
+                    else if (!VerifySignature(txPrev, *this, i, flags, 0))
+                        return InputScriptFailed(txPrev, *this, i, flags);
                 }
             }
 
@@ -1869,52 +2347,68 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+// Collect the address ids a transaction is indexed under: those of all
+// outputs of the transactions it spends, and those of its own outputs.
+static void GetTxAddrIds(const CTransaction& tx, const MapPrevTx& mapInputs, std::set<uint160>& setAddrIds)
+{
+    // inputs
+    for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+    {
+        BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
+        {
+            std::vector<uint160> addrIds;
+            if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
+                setAddrIds.insert(addrIds.begin(), addrIds.end());
+        }
+    }
+    // outputs
+    BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+    {
+        std::vector<uint160> addrIds;
+        if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
+            setAddrIds.insert(addrIds.begin(), addrIds.end());
+    }
+}
+
+void CBlock::RebuildAddressIndex(CTxDB& txdb, int nHeight)
 {
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
-        // inputs
+        MapPrevTx mapInputs;
         if(!tx.IsCoinBase())
         {
-            MapPrevTx mapInputs;
             map<uint256, CTxIndex> mapQueuedChangesT;
             bool fInvalid;
             if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
                 return;
-
-            MapPrevTx::const_iterator mi;
-            for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-            {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                {
-                    std::vector<uint160> addrIds;
-                    if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                    {
-                        BOOST_FOREACH(uint160 addrId, addrIds)
-                        {
-                            if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        }
-                    }
-                }
-            }
         }
-        // outputs
-        BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-            std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-            {
-                BOOST_FOREACH(uint160 addrId, addrIds)
-                {
-                    if(!txdb.WriteAddrIndex(addrId, hashTx))
-                        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
-            }
+
+        std::set<uint160> setAddrIds;
+        GetTxAddrIds(tx, mapInputs, setAddrIds);
+        BOOST_FOREACH(const uint160& addrId, setAddrIds)
+        {
+            if(!txdb.WriteAddrIndex(addrId, nHeight, hashTx))
+                LogPrintf("RebuildAddressIndex(): WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
         }
     }
 }
 
+bool CScriptCheck::operator()() const
+{
+    return VerifySignature(*ptxFrom, *ptxTo, nIn, nFlags, nHashType);
+}
+
+bool CScriptCheck::ReportFailure() const
+{
+    return InputScriptFailed(*ptxFrom, *ptxTo, nIn, nFlags);
+}
+
+void ThreadScriptCheck() {
+    RenameThread("Rev-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1944,6 +2438,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
     MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 
+    // Input fetching and value accounting stay on this thread, in block order;
+    // only the per-input script checks are handed to the worker threads.
+    LOCK(cs_scriptcheckqueue);
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    // Address ids each transaction is to be indexed under
+    bool fAddrIndexing = !fJustCheck && GetBoolArg("-addrindex", false);
+    std::vector<std::pair<uint256, std::set<uint160> > > vAddrIndex;
+
+    // Copies of the queued checks, to find the one that failed
+    std::vector<CScriptCheck> vScriptChecks;
+
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
@@ -1983,13 +2489,33 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 nStakeReward = nTxValueOut - nTxValueIn;
 
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            vScriptChecks.insert(vScriptChecks.end(), vChecks.begin(), vChecks.end());
+            control.Add(vChecks);
+        }
+
+        if (fAddrIndexing)
+        {
+            vAddrIndex.push_back(std::make_pair(hashTx, std::set<uint160>()));
+            GetTxAddrIds(tx, mapInputs, vAddrIndex.back().second);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    // Join the script check workers before any further block-level checks.
+    // The queue only tells that some check failed; find the first one and
+    // report it as ConnectInputs() does when checking serially.
+    if (!control.Wait())
+    {
+        BOOST_FOREACH(const CScriptCheck& check, vScriptChecks)
+            if (!check())
+                return check.ReportFailure();
+        return error("ConnectBlock() : script verification failed");
+    }
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -2028,52 +2554,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
-    if(GetBoolArg("-addrindex", false))
+    // Write address index, reusing the inputs fetched above
+    for (unsigned int i = 0; i < vAddrIndex.size(); i++)
     {
-        // Write Address Index
-        BOOST_FOREACH(CTransaction& tx, vtx)
+        const uint256& hashTx = vAddrIndex[i].first;
+        BOOST_FOREACH(const uint160& addrId, vAddrIndex[i].second)
         {
-            uint256 hashTx = tx.GetHash();
-            // inputs
-            if(!tx.IsCoinBase())
-            {
-                MapPrevTx mapInputs;
-                map<uint256, CTxIndex> mapQueuedChangesT;
-                bool fInvalid;
-                if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                    return false;
-
-                MapPrevTx::const_iterator mi;
-                for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-                {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                    {
-                        std::vector<uint160> addrIds;
-                        if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                        {
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-                            {
-                                if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-                        }
-                    }
-                }
-            }
-
-            // outputs
-            BOOST_FOREACH(const CTxOut &atxout, tx.vout)
-            {
-                std::vector<uint160> addrIds;
-                if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                {
-                    BOOST_FOREACH(uint160 addrId, addrIds)
-                    {
-                        if(!txdb.WriteAddrIndex(addrId, hashTx))
-                            LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                    }
-                }
-            }
+            if(!txdb.WriteAddrIndex(addrId, pindex->nHeight, hashTx))
+                LogPrintf("ConnectBlock(): WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
         }
     }
 
@@ -2358,7 +2846,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2445,6 +2933,22 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
     return true;
 }
 
+static CCriticalSection cs_blockIndexArena;
+static std::vector<char*> vBlockIndexChunks;
+static size_t nBlockIndexChunkUsed = 0;
+static const size_t BLOCKINDEX_CHUNK_ENTRIES = 4096;
+
+void* AllocateBlockIndex()
+{
+    LOCK(cs_blockIndexArena);
+    if (vBlockIndexChunks.empty() || nBlockIndexChunkUsed == BLOCKINDEX_CHUNK_ENTRIES)
+    {
+        vBlockIndexChunks.push_back(static_cast<char*>(::operator new(BLOCKINDEX_CHUNK_ENTRIES * sizeof(CBlockIndex))));
+        nBlockIndexChunkUsed = 0;
+    }
+    return vBlockIndexChunks.back() + sizeof(CBlockIndex) * nBlockIndexChunkUsed++;
+}
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof)
 {
     AssertLockHeld(cs_main);
@@ -2455,15 +2959,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
+    CBlockIndex* pindexNew = new (AllocateBlockIndex()) CBlockIndex(nFile, nBlockPos, *this);
      {
           LOCK(cs_nBlockSequenceId);
           pindexNew->nSequenceId = nBlockSequenceId++;
      }
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2489,7 +2991,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2822,7 +3324,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2933,7 +3435,7 @@ bool CBlock::AcceptBlock()
 }
 
 /* Calculates trust score for a block given */
-uint256 CBlockIndex::GetBlockTrust() const
+uint256 GetBlockTrust(unsigned int nBits)
 {
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
@@ -2944,6 +3446,11 @@ uint256 CBlockIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
+uint256 CBlockIndex::GetBlockTrust() const
+{
+    return ::GetBlockTrust(nBits);
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
@@ -2969,6 +3476,8 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Also called from handlers that run without cs_main, like smsg
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2982,6 +3491,23 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name.c_str(), state->nMisbehavior-howmuch, state->nMisbehavior);
 }
 
+// Serialize an item for the relay cache, which every peer asking for it is
+// then served from
+template<typename T>
+static CSharedMessage CacheMessage(const CInv& inv, const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    FinishMessage(ss);
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    CSharedMessage msg(pdata);
+    relayCache.Put(inv, msg);
+    return msg;
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     AssertLockHeld(cs_main);
@@ -2990,13 +3516,13 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     uint256 hash = pblock->GetHash();
     if (mapBlockIndex.count(hash))
         return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
-    if (mapOrphanBlocks.count(hash))
+    if (orphanBlocks.Has(hash))
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
 
     // ppcoin: check proof-of-stake
     // Limited duplicity on stake: prevents block flood attack
     // Duplicate stake allowed only when there is orphan child block
-    if (!fReindex && !fImporting && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
+    if (!fReindex && !fImporting && pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !orphanBlocks.HasChildren(hash))
         return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
 
     if (pblock->hashPrevBlock != hashBestChain)
@@ -3038,7 +3564,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         //    return error("ProcessBlock() : Demi-node orphan blocks are not accepted from peer: %s", pfrom->addrName);
         //}
 
-        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
+        LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)orphanBlocks.size(), pblock->hashPrevBlock.ToString());
 
         // Accept orphans as long as there is a node to request its parents from
         if (pfrom) {
@@ -3047,30 +3573,22 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             {
                 // Limited duplicity on stake: prevents block flood attack
                 // Duplicate stake allowed only when there is orphan child block
-                if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash))
+                if (orphanBlocks.HasStake(pblock->GetProofOfStake()) && !orphanBlocks.HasChildren(hash))
                     return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
             }
-            PruneOrphanBlocks();
-            COrphanBlock* pblock2 = new COrphanBlock();
+            orphanBlocks.Add(*pblock);
+
+            // Blocks of the header chain are fetched parents and all; the
+            // missing ones are on their way already
+            if (!mapHeaders.count(hash))
             {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
+                // Ask this guy to fill in what we're missing
+                PushGetBlocks(pfrom, pindexBest, orphanBlocks.GetRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, orphanBlocks.GetWanted(hash)));
             }
-            pblock2->hashBlock = hash;
-            pblock2->hashPrev = pblock->hashPrevBlock;
-            pblock2->stake = pblock->GetProofOfStake();
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
-            if (pblock->IsProofOfStake())
-                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
-
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
         }
         return true;
     }
@@ -3079,29 +3597,33 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
+    // Every peer is about to ask for a new tip; have it ready for them
+    if (hash == hashBestChain && !IsInitialBlockDownload())
+        CacheMessage(CInv(MSG_BLOCK, hash), "block", *pblock);
+
+    // Connect every orphan block descending from this one, parents first.
+    // The descendants of an orphan that fails can never connect, so they go
+    // with it.
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        vector<uint256> vChildren;
+        orphanBlocks.GetChildren(vWorkQueue[i], vChildren);
+        BOOST_FOREACH(const uint256& hashChild, vChildren)
         {
             CBlock block;
+            if (orphanBlocks.Take(hashChild, block))
             {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
+                block.BuildMerkleTree();
+                if (block.AcceptBlock())
+                {
+                    vWorkQueue.push_back(hashChild);
+                    continue;
+                }
             }
-            block.BuildMerkleTree();
-            if (block.AcceptBlock())
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            setStakeSeenOrphan.erase(block.GetProofOfStake());
-            delete mi->second;
+            orphanBlocks.EraseDescendants(hashChild);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     // Check block against Velocity parameters
@@ -3182,7 +3704,9 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
 
     if (nSearchTime > nLastCoinStakeSearchTime)
     {
-        int64_t nSearchInterval = 1;
+        // Also covers the timestamps that came and went since the last
+        // search, CreateCoinStake() caps how far back that goes
+        int64_t nSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
         if (wallet.CreateCoinStake(wallet, nBits, nSearchInterval, nFees, txCoinStake, key))
         {
             if (txCoinStake.nTime >= pindexBest->GetPastTimeLimit()+1)
@@ -3311,6 +3835,9 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
 
+    if (GetBoolArg("-addrindex", false) && !txdb.MigrateAddrIndex())
+        return false;
+
     //
     // Init with genesis block
     //
@@ -3339,7 +3866,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3377,96 +3904,321 @@ void PrintBlockTree()
         for (int i = 0; i < nCol; i++)
             LogPrintf("| ");
 
-        // print item
-        CBlock block;
-        block.ReadFromDisk(pindex);
-        LogPrintf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %u",
-            pindex->nHeight,
-            pindex->nFile,
-            pindex->nBlockPos,
-            block.GetHash().ToString(),
-            block.nBits,
-            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()),
-            FormatMoney(pindex->nMint),
-            block.vtx.size());
+        // print item
+        CBlock block;
+        block.ReadFromDisk(pindex);
+        LogPrintf("%d (%u,%u) %s  %08x  %s  mint %7s  tx %u",
+            pindex->nHeight,
+            pindex->nFile,
+            pindex->nBlockPos,
+            block.GetHash().ToString(),
+            block.nBits,
+            DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()),
+            FormatMoney(pindex->nMint),
+            block.vtx.size());
+
+        // put the main time-chain first
+        vector<CBlockIndex*>& vNext = mapNext[pindex];
+        for (unsigned int i = 0; i < vNext.size(); i++)
+        {
+            if (vNext[i]->pnext)
+            {
+                swap(vNext[0], vNext[i]);
+                break;
+            }
+        }
+
+        // iterate children
+        for (unsigned int i = 0; i < vNext.size(); i++)
+            vStack.push_back(make_pair(nCol+i, vNext[i]));
+    }
+}
+
+// Sequential reader for block files (bootstrap.dat, -loadblock): hands out
+// the serialized blocks that follow each message start, from a large
+// read-ahead buffer rather than a seek and a read per block.
+class CBlockFileReader
+{
+private:
+    FILE* file;
+    std::vector<char> vBuf;
+    size_t nBegin;
+    size_t nEnd;
+    bool fEof;
+
+    // Have at least nNeed unread bytes in the buffer, unless the file ends
+    bool Fill(size_t nNeed)
+    {
+        while (nEnd - nBegin < nNeed)
+        {
+            if (fEof)
+                return false;
+            if (nBegin > 0)
+            {
+                memmove(&vBuf[0], &vBuf[nBegin], nEnd - nBegin);
+                nEnd -= nBegin;
+                nBegin = 0;
+            }
+            if (vBuf.size() < std::max(nNeed, IMPORT_READ_BUFFER_SIZE))
+                vBuf.resize(std::max(nNeed, IMPORT_READ_BUFFER_SIZE));
+            size_t nRead = fread(&vBuf[nEnd], 1, vBuf.size() - nEnd, file);
+            if (nRead == 0)
+                fEof = true;
+            nEnd += nRead;
+        }
+        return true;
+    }
+
+public:
+    CBlockFileReader(FILE* fileIn) : file(fileIn), nBegin(0), nEnd(0), fEof(false) {}
+
+    // Append the next block to vchOut; false at the end of the file
+    bool Next(std::vector<char>& vchOut)
+    {
+        while (Fill(MESSAGE_START_SIZE + sizeof(unsigned int)))
+        {
+            const char* pbegin = &vBuf[nBegin];
+            const char* pend = &vBuf[nEnd] - (MESSAGE_START_SIZE - 1);
+            const char* pfind = pbegin;
+            while ((pfind = (const char*)memchr(pfind, Params().MessageStart()[0], pend - pfind)) != NULL &&
+                   memcmp(pfind, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+                pfind++;
+            if (pfind == NULL)
+            {
+                nBegin = nEnd - (MESSAGE_START_SIZE - 1);
+                continue;
+            }
+            nBegin += (pfind - pbegin) + MESSAGE_START_SIZE;
+            if (!Fill(sizeof(unsigned int)))
+                return false;
+
+            unsigned int nSize;
+            memcpy(&nSize, &vBuf[nBegin], sizeof(nSize));
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                continue;
+            if (!Fill(sizeof(nSize) + nSize))
+                return false;
+            nBegin += sizeof(nSize);
+            vchOut.insert(vchOut.end(), &vBuf[nBegin], &vBuf[nBegin] + nSize);
+            nBegin += nSize;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Blocks read from a block file, deserialized and hashed by worker threads
+// while the blocks before them are being connected.
+class CImportBatch
+{
+public:
+    std::vector<char> vchRaw;
+    std::vector<std::pair<size_t, size_t> > vSpans;
+    std::vector<CBlock> vBlocks;
+    std::vector<uint256> vHashes;    // 0 if the block did not deserialize
+
+private:
+    boost::thread_group* pdecoders;
+
+    // Decode blocks [nBegin, nEnd); several of these run at once on
+    // disjoint ranges.
+    void Decode(size_t nBegin, size_t nEnd)
+    {
+        for (size_t i = nBegin; i < nEnd; i++)
+        {
+            try {
+                const char* pbegin = &vchRaw[vSpans[i].first];
+                CDataStream ss(pbegin, pbegin + vSpans[i].second, SER_DISK, CLIENT_VERSION);
+                ss >> vBlocks[i];
+                vHashes[i] = vBlocks[i].GetHash();
+            }
+            catch (std::exception &e) {
+                LogPrintf("LoadExternalBlockFile() : deserialize error in block file: %s\n", e.what());
+                vHashes[i] = 0;
+            }
+        }
+    }
+
+public:
+    CImportBatch() : pdecoders(NULL) {}
+    ~CImportBatch() { Join(); }
+
+    bool empty() const { return vSpans.empty(); }
+
+    // Read blocks up to IMPORT_BATCH_SIZE bytes; false if there were none
+    bool Read(CBlockFileReader& reader)
+    {
+        vchRaw.clear();
+        vSpans.clear();
+        while (vchRaw.size() < IMPORT_BATCH_SIZE)
+        {
+            size_t nStart = vchRaw.size();
+            if (!reader.Next(vchRaw))
+                break;
+            vSpans.push_back(make_pair(nStart, vchRaw.size() - nStart));
+        }
+        return !vSpans.empty();
+    }
+
+    void StartDecode(size_t nThreads)
+    {
+        vBlocks.assign(vSpans.size(), CBlock());
+        vHashes.assign(vSpans.size(), uint256(0));
+        size_t nChunk = (vSpans.size() + nThreads - 1) / nThreads;
+        pdecoders = new boost::thread_group();
+        for (size_t nBegin = 0; nBegin < vSpans.size(); nBegin += nChunk)
+            pdecoders->create_thread(boost::bind(&CImportBatch::Decode, this, nBegin, std::min(nBegin + nChunk, vSpans.size())));
+    }
+
+    void Join()
+    {
+        if (pdecoders)
+        {
+            pdecoders->join_all();
+            delete pdecoders;
+            pdecoders = NULL;
+        }
+    }
+};
+
+// The connect stage of LoadExternalBlockFile. Block files are mostly in
+// chain order; blocks that come before their parent wait here, up to
+// MAX_IMPORT_PENDING_SIZE bytes. ProcessBlock() keeps no orphans without a
+// peer to ask for their parents, so a block whose parent is still missing
+// when it has to go is dropped, and counted as such.
+class CBlockImporter
+{
+private:
+    std::map<uint256, CBlock> mapPending;
+    std::multimap<uint256, uint256> mapPendingByPrev;
+    uint64_t nPendingBytes;
+
+    void Process(CBlock& block)
+    {
+        LOCK(cs_main);
+        if (!mapBlockIndex.count(block.hashPrevBlock))
+            nDropped++;
+        else if (ProcessBlock(NULL, &block))
+            nLoaded++;
+    }
+
+    void Connect(CBlock& block)
+    {
+        Process(block);
+
+        // Then the blocks that were waiting for it, parents first
+        vector<uint256> vWorkQueue(1, block.GetHash());
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            multimap<uint256, uint256>::iterator it;
+            while ((it = mapPendingByPrev.find(vWorkQueue[i])) != mapPendingByPrev.end())
+            {
+                map<uint256, CBlock>::iterator mi = mapPending.find(it->second);
+                mapPendingByPrev.erase(it);
+                if (mi == mapPending.end())
+                    continue;
+                nPendingBytes -= ::GetSerializeSize(mi->second, SER_DISK, CLIENT_VERSION);
+                Process(mi->second);
+                vWorkQueue.push_back(mi->first);
+                mapPending.erase(mi);
+            }
+        }
+    }
+
+public:
+    int nLoaded;
+    int nKnown;
+    int nDropped;
 
-        // put the main time-chain first
-        vector<CBlockIndex*>& vNext = mapNext[pindex];
-        for (unsigned int i = 0; i < vNext.size(); i++)
+    CBlockImporter() : nPendingBytes(0), nLoaded(0), nKnown(0), nDropped(0) {}
+
+    void Import(CBlock& block, const uint256& hash, unsigned int nSize)
+    {
         {
-            if (vNext[i]->pnext)
+            LOCK(cs_main);
+            if (mapBlockIndex.count(hash) || mapPending.count(hash))
             {
-                swap(vNext[0], vNext[i]);
-                break;
+                nKnown++;
+                return;
+            }
+            if (!mapBlockIndex.count(block.hashPrevBlock) && nPendingBytes + nSize <= MAX_IMPORT_PENDING_SIZE)
+            {
+                mapPending[hash] = block;
+                mapPendingByPrev.insert(make_pair(block.hashPrevBlock, hash));
+                nPendingBytes += nSize;
+                return;
             }
         }
+        Connect(block);
+    }
 
-        // iterate children
-        for (unsigned int i = 0; i < vNext.size(); i++)
-            vStack.push_back(make_pair(nCol+i, vNext[i]));
+    // Whatever is left never saw its parent in this file
+    void Flush()
+    {
+        {
+            LOCK(cs_main);
+            for (map<uint256, CBlock>::iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+                if (!mapBlockIndex.count(it->first))
+                    nDropped++;
+        }
+        mapPending.clear();
+        mapPendingByPrev.clear();
+        nPendingBytes = 0;
     }
-}
+};
 
+// Import the blocks of a block file in three overlapping stages: the next
+// batch is read while the current one is decoded on worker threads, and
+// decoded batches are connected in file order on this thread.
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
-    int nLoaded = 0;
+    size_t nThreads = std::max(1U, boost::thread::hardware_concurrency());
+    nThreads = std::min<size_t>(nThreads, MAX_IMPORT_DECODE_THREADS);
+
+    CBlockImporter importer;
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        CBlockFileReader reader(blkdat);
+        CImportBatch batches[2];
+        CImportBatch* pcurrent = &batches[0];
+        CImportBatch* pnext = &batches[1];
+        if (pcurrent->Read(reader))
+            pcurrent->StartDecode(nThreads);
+
+        int64_t nLastProgress = GetTimeMillis();
+        while (!pcurrent->empty())
+        {
+            boost::this_thread::interruption_point();
+            bool fMore = pnext->Read(reader);
+            pcurrent->Join();
+            if (fMore)
+                pnext->StartDecode(nThreads);
+
+            for (size_t i = 0; i < pcurrent->vSpans.size(); i++)
             {
                 boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
-                }
+                if (pcurrent->vHashes[i] != 0)
+                    importer.Import(pcurrent->vBlocks[i], pcurrent->vHashes[i], pcurrent->vSpans[i].second);
             }
+            pcurrent->vBlocks.clear();
+
+            if (GetTimeMillis() - nLastProgress > 10000)
+            {
+                nLastProgress = GetTimeMillis();
+                LogPrintf("Importing blocks: %i loaded, %.1f blocks/s, height %d\n",
+                    importer.nLoaded, importer.nLoaded * 1000.0 / std::max((int64_t)1, nLastProgress - nStart), nBestHeight);
+            }
+            std::swap(pcurrent, pnext);
         }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
-        }
+        importer.Flush();
     }
-    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+
+    int64_t nElapsed = std::max((int64_t)1, GetTimeMillis() - nStart);
+    LogPrintf("Loaded %i blocks from external file in %dms (%.1f blocks/s, %i already known, %i without parent dropped)\n",
+        importer.nLoaded, nElapsed, importer.nLoaded * 1000.0 / nElapsed, importer.nKnown, importer.nDropped);
+    return importer.nLoaded > 0;
 }
 
 struct CImportingNow
@@ -3486,25 +4238,157 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("Rev-loadblk");
 
-    CImportingNow imp;
-
-    // -loadblock=
-    BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file)
-            LoadExternalBlockFile(file);
+    {
+        CImportingNow imp;
+
+        // -loadblock=
+        BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
+            FILE *file = fopen(path.string().c_str(), "rb");
+            if (file)
+                LoadExternalBlockFile(file);
+        }
+
+        // hardcoded $DATADIR/bootstrap.dat
+        filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
+        if (filesystem::exists(pathBootstrap)) {
+            FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
+            if (file) {
+                filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+                LoadExternalBlockFile(file);
+                RenameOver(pathBootstrap, pathBootstrapOld);
+            }
+        }
     }
 
-    // hardcoded $DATADIR/bootstrap.dat
-    filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
-    if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
+    // $DATADIR/mempool.dat, once the chain it was saved against is back
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+    fMempoolLoaded = true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool persistence
+//
+
+// mempool.dat holds this version, the number of transactions, and then each
+// transaction with the time it entered the pool, oldest first
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+// Transactions that sat in the pool longer than this are not loaded again
+static const int64_t MEMPOOL_LOAD_MAX_AGE = 14 * 24 * 60 * 60;
+// Transactions accepted per cs_main lock while loading
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+
+    int64_t nNow = GetTime();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+    try {
+        uint64_t nVersion, nCount;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool : unknown version %u", (unsigned int)nVersion);
+        filein >> nCount;
+
+        while (nCount > 0)
+        {
+            // Read a batch without the lock, then accept it under one
+            vector<pair<CTransaction, int64_t> > vtx;
+            while (nCount > 0 && vtx.size() < MEMPOOL_LOAD_BATCH)
+            {
+                CTransaction tx;
+                int64_t nTime;
+                filein >> tx >> nTime;
+                nCount--;
+                if (nTime + MEMPOOL_LOAD_MAX_AGE < nNow)
+                    nExpired++;
+                else
+                    vtx.push_back(make_pair(tx, nTime));
+            }
+
+            {
+                LOCK(cs_main);
+                for (unsigned int i = 0; i < vtx.size(); i++)
+                {
+                    // As AcceptToMemoryPool(), but the entry keeps the time
+                    // the transaction first entered the pool
+                    CTransaction& tx = vtx[i].first;
+                    CTxAdmission admission;
+                    if (CheckTxForMempool(tx) &&
+                        AcceptTxInputs(mempool, tx, true, NULL, false, false, admission, true) &&
+                        (!admission.fFree || LimitFreeRelay(admission.entry.nTxSize)) &&
+                        VerifyTxScripts(admission))
+                    {
+                        admission.entry.nTime = vtx[i].second;
+                        if (AddTxToMemoryPool(mempool, tx, admission, false))
+                        {
+                            nAccepted++;
+                            continue;
+                        }
+                    }
+                    nFailed++;
+                }
+            }
+            boost::this_thread::interruption_point();
         }
     }
+    catch (boost::thread_interrupted) {
+        throw;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool : failed to read %s: %s", path.string(), e.what());
+    }
+
+    LogPrintf("Loaded mempool in %dms: %u accepted, %u failed or already known, %u expired\n",
+        GetTimeMillis() - nStart, nAccepted, nFailed, nExpired);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    vector<pair<CTransaction, int64_t> > vtx;
+    {
+        LOCK(mempool.cs);
+        vtx.reserve(mempool.setByTime.size());
+        BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, mempool.setByTime)
+            vtx.push_back(make_pair(mempool.mapTx[item.second], item.first));
+    }
+
+    filesystem::path path = GetDataDir() / "mempool.dat";
+    filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("DumpMempool : failed to open %s", pathTmp.string());
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vtx.size();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            fileout << vtx[i].first << vtx[i].second;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool : failed to write %s: %s", pathTmp.string(), e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path))
+        return error("DumpMempool : failed to rename %s", pathTmp.string());
+
+    LogPrintf("Dumped %u mempool transactions in %dms\n", vtx.size(), GetTimeMillis() - nStart);
+    return true;
 }
 
 
@@ -3580,6 +4464,55 @@ string GetWarnings(string strFor)
 //
 
 
+// Retries the orphans spending outputs of the transactions in vWorkQueue,
+// which just made it into the pool or the chain. An orphan is only retried
+// once none of its parents is an orphan any more, so chains of orphans are
+// accepted parents first; accepted orphans are queued in turn.
+void static ProcessOrphanTxs(vector<uint256>& vWorkQueue)
+{
+    AssertLockHeld(cs_main);
+    for (unsigned int i = 0; i < vWorkQueue.size() && !mapOrphanTransactions.empty(); i++)
+    {
+        uint256 hashParent = vWorkQueue[i];
+        set<uint256> setOrphans;
+        map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hashParent, 0));
+        for (; itByPrev != mapOrphanTransactionsByPrev.end() && itByPrev->first.hash == hashParent; ++itByPrev)
+            setOrphans.insert(itByPrev->second.begin(), itByPrev->second.end());
+
+        BOOST_FOREACH(const uint256& orphanTxHash, setOrphans)
+        {
+            map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.find(orphanTxHash);
+            if (mi == mapOrphanTransactions.end())
+                continue;
+            COrphanTx& orphan = mi->second;
+
+            bool fOrphanParent = false;
+            BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+                fOrphanParent |= (mapOrphanTransactions.count(txin.prevout.hash) > 0);
+            if (fOrphanParent)
+                continue;
+
+            bool fMissingInputs2 = false;
+            if (AcceptToMemoryPool(mempool, orphan.tx, true, &fMissingInputs2))
+            {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
+                RelayTransaction(orphan.tx, orphanTxHash);
+                vWorkQueue.push_back(orphanTxHash);
+                EraseOrphanTx(orphanTxHash);
+            }
+            else if (!fMissingInputs2)
+            {
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                if (orphan.tx.nDoS > 0)
+                    Misbehaving(orphan.fromPeer, orphan.tx.nDoS);
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
+                EraseOrphanTx(orphanTxHash);
+            }
+        }
+    }
+}
+
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
@@ -3597,7 +4530,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               orphanBlocks.Has(inv.hash);
     case MSG_TXLOCK_REQUEST:
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
@@ -3613,14 +4546,15 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 }
 
 // NOTE: Called from "ProcessMessage" when "getdata" is flagged
+// Runs without cs_main; it is only taken to look up what was asked for, so
+// reading blocks from disk and serializing them holds up no other peer.
+// Block index entries are never freed, so they can be used after.
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3634,23 +4568,41 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                const CBlockIndex* pindex = NULL;
+                uint256 hashBest;
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-
-                    // Send the requested block to peer
-                    pfrom->PushMessage("block", block);
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = mi->second;
+                    hashBest = hashBestChain;
+                }
+                if (pindex)
+                {
+                    // Send the requested block to peer, read and serialized
+                    // once for all peers that ask for it
+                    CInv invBlock(MSG_BLOCK, inv.hash);
+                    CSharedMessage msg;
+                    if (!relayCache.Get(invBlock, msg))
+                    {
+                        // A block that fails to read is neither cached nor sent
+                        CBlock block;
+                        if (block.ReadFromDisk(pindex))
+                            msg = CacheMessage(invBlock, "block", block);
+                    }
+                    if (msg)
+                        pfrom->PushSharedMessage(msg);
+                    else
+                        vNotFound.push_back(inv);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (msg && inv.hash == pfrom->hashContinue)
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3658,45 +4610,35 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.type == MSG_DEMIBLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send the requested block to peer, or else the best available
+                const CBlockIndex* pindex;
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-
-                    // Send the requested block to peer
-                    pfrom->PushMessage("demiblock", block);
-                } else {
-                    // Send best available block to peer
-                    map<uint256, CBlockIndex*>::iterator mi2 = mapBlockIndex.find(pindexBest->GetBlockHash());
-                    CBlock block;
-                    block.ReadFromDisk((*mi2).second);
-                    pfrom->PushMessage("demiblock", block);
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    pindex = (mi != mapBlockIndex.end() ? mi->second : pindexBest);
                 }
+                CBlock block;
+                block.ReadFromDisk(pindex);
+                pfrom->PushMessage("demiblock", block);
             }
             else if (inv.IsKnownType())
             {
+                LOCK(cs_main);
                 if(fDebug) LogPrintf("ProcessGetData -- Starting \n");
                 // Send stream from relay memory
                 bool pushed = false;
-                /*{
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        if(fDebug) LogPrintf("ProcessGetData -- pushed = true Rest will fail\n");
-                        pushed = true;
-                    }
-                }*/
                 if (!pushed && inv.type == MSG_TX) {
 
+                    // Only transactions still in the pool are sent, from
+                    // relay memory if they are there
+                    CSharedMessage msg;
                     CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    if (mempool.exists(inv.hash) && relayCache.Get(inv, msg)) {
+                        pfrom->PushSharedMessage(msg);
+                        pushed = true;
+                    }
+                    else if (mempool.lookup(inv.hash, tx)) {
+                        pfrom->PushSharedMessage(CacheMessage(inv, "tx", tx));
                         pushed = true;
                     }
                 }
@@ -3777,6 +4719,20 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Messages that are handled without cs_main held, as they either touch no
+// chain state or lock it themselves around the parts that do; getdata and
+// getblocks only for their lookups, not for the disk reads and pushes.
+// Everything else, masternode, spork and InstantX messages included, reads
+// the chain or mempool throughout and runs under cs_main.
+static bool HandlerLocksMain(const string& strCommand)
+{
+    return strCommand == "verack" || strCommand == "addr" || strCommand == "getaddr" ||
+           strCommand == "ping" || strCommand == "pong" ||
+           strCommand == "tx" || strCommand == "dstx" ||
+           strCommand == "getdata" || strCommand == "getblocks" ||
+           strCommand.compare(0, 4, "smsg") == 0;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3787,10 +4743,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
-    {
-        LOCK(cs_main);
+    // Handlers that lock cs_main themselves leave this alone; it only
+    // matters for telling block download stalls from a busy node.
+    if (!HandlerLocksMain(strCommand))
         State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
-    }
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -4011,6 +4967,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK)
+                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex) {
                     if (inv.type == MSG_BLOCK)
@@ -4018,8 +4977,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     else
                         pfrom->AskFor(inv);
                 }
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
+            } else if (inv.type == MSG_BLOCK && orphanBlocks.Has(inv.hash)) {
+                PushGetBlocks(pfrom, pindexBest, orphanBlocks.GetRoot(inv.hash));
             }
 
             // Track requests for our stuff
@@ -4059,33 +5018,39 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+        // The chain is walked under cs_main, the inventory queued after
+        vector<uint256> vHashes;
+        {
+            LOCK(cs_main);
 
-        // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = locator.GetBlockIndex();
+            // Find the last block the caller has in the main chain
+            CBlockIndex* pindex = locator.GetBlockIndex();
 
-        // Send the rest of the chain
-        if (pindex)
-            pindex = pindex->pnext;
-        int nLimit = 5000;
-        LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
-        for (; pindex; pindex = pindex->pnext)
-        {
-            if (pindex->GetBlockHash() == hashStop)
-            {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0)
+            // Send the rest of the chain
+            if (pindex)
+                pindex = pindex->pnext;
+            int nLimit = 5000;
+            LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
+            for (; pindex; pindex = pindex->pnext)
             {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
+                if (pindex->GetBlockHash() == hashStop)
+                {
+                    LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                    break;
+                }
+                vHashes.push_back(pindex->GetBlockHash());
+                if (--nLimit <= 0)
+                {
+                    // When this block is requested, we'll send an inv that'll make them
+                    // getblocks the next batch of inventory.
+                    LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                    pfrom->hashContinue = pindex->GetBlockHash();
+                    break;
+                }
             }
         }
+        BOOST_FOREACH(const uint256& hash, vHashes)
+            pfrom->PushInventory(CInv(MSG_BLOCK, hash));
     }
 
     else if (strCommand == "getheaders")
@@ -4103,7 +5068,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4117,7 +5082,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -4129,10 +5094,55 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        // Only headers we asked this peer for are taken
+        if (!state->nHeadersRequestTime)
+        {
+            LogPrint("net", "ignoring unrequested headers from peer=%d\n", pfrom->id);
+            return true;
+        }
+        state->nHeadersRequestTime = 0;
+
+        bool fAllAccepted = true;
+        bool fFull = false;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (mapHeaders.size() >= (size_t)MAX_HEADERS_AHEAD)
+            {
+                // The rest is asked for again once blocks have come in
+                fFull = true;
+                break;
+            }
+            int nHeight;
+            if (!AcceptHeader(header, nHeight))
+            {
+                if (header.nDoS)
+                    Misbehaving(pfrom->GetId(), header.nDoS);
+                fAllAccepted = false;
+                break;
+            }
+            UpdateBlockAvailability(pfrom->GetId(), header.GetHash());
+        }
+        state->fMoreHeaders = fFull || (fAllAccepted && vHeaders.size() == MAX_HEADERS_RESULTS);
+
+        LogPrint("net", "received %u headers from peer=%d, best header %d, %u ahead of the tip\n",
+            vHeaders.size(), pfrom->id, nBestHeaderHeight, vHeaderChain.size());
+    }
+
+
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -4141,112 +5151,87 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv;
         vector<unsigned char> vchSig;
         int64_t sigTime;
-        CTxDB txdb("r");
-
-        if(strCommand == "tx") {
-            vRecv >> tx;
-            inv = CInv(MSG_TX, tx.GetHash());
-            // Check for recently rejected (and do other quick existence checks)
-            if (AlreadyHave(txdb, inv))
-                return true;
-        }
-        else if (strCommand == "dstx") {
-            vRecv >> tx >> vin >> vchSig >> sigTime;
-            inv = CInv(MSG_DSTX, tx.GetHash());
-            // Check for recently rejected (and do other quick existence checks)
-            if (AlreadyHave(txdb, inv))
-                return true;
-            //these allow masternodes to publish a limited amount of free transactions
 
-            CMasternode* pmn = mnodeman.Find(vin);
-            if(pmn != NULL)
-            {
-                if(!pmn->allowFreeTx){
-                    //multiple peers can send us a valid masternode transaction
-                    if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
+        {
+            LOCK(cs_main);
+            CTxDB txdb("r");
+
+            if(strCommand == "tx") {
+                vRecv >> tx;
+                inv = CInv(MSG_TX, tx.GetHash());
+                // Check for recently rejected (and do other quick existence checks)
+                if (AlreadyHave(txdb, inv))
                     return true;
-                }
+            }
+            else if (strCommand == "dstx") {
+                vRecv >> tx >> vin >> vchSig >> sigTime;
+                inv = CInv(MSG_DSTX, tx.GetHash());
+                // Check for recently rejected (and do other quick existence checks)
+                if (AlreadyHave(txdb, inv))
+                    return true;
+                //these allow masternodes to publish a limited amount of free transactions
+
+                CMasternode* pmn = mnodeman.Find(vin);
+                if(pmn != NULL)
+                {
+                    if(!pmn->allowFreeTx){
+                        //multiple peers can send us a valid masternode transaction
+                        if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
+                        return true;
+                    }
 
-                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+                    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
 
-                std::string errorMessage = "";
-                if(!mnEngineSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
-                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                    //Misbehaving(pfrom->GetId(), 20);
-                    return false;
-                }
+                    std::string errorMessage = "";
+                    if(!mnEngineSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
+                        LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                        //Misbehaving(pfrom->GetId(), 20);
+                        return false;
+                    }
 
-                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
+                    LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
 
-                ignoreFees = true;
-                pmn->allowFreeTx = false;
+                    ignoreFees = true;
+                    pmn->allowFreeTx = false;
 
-                if(!mapMNengineBroadcastTxes.count(tx.GetHash())){
-                    CMNengineBroadcastTx dstx;
-                    dstx.tx = tx;
-                    dstx.vin = vin;
-                    dstx.vchSig = vchSig;
-                    dstx.sigTime = sigTime;
+                    if(!mapMNengineBroadcastTxes.count(tx.GetHash())){
+                        CMNengineBroadcastTx dstx;
+                        dstx.tx = tx;
+                        dstx.vin = vin;
+                        dstx.vchSig = vchSig;
+                        dstx.sigTime = sigTime;
 
-                    mapMNengineBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
+                        mapMNengineBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
+                    }
                 }
             }
         }
 
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
+        // Checked before cs_main is taken, so a flood of transactions only
+        // holds it for the input lookups and the insertions
         bool fMissingInputs = false;
+        bool fAccepted = AcceptToMemoryPoolConcurrent(mempool, tx, true, &fMissingInputs, false, ignoreFees);
+
+        LOCK(cs_main);
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv);
 
-        if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs, false, ignoreFees))
+        if (fAccepted)
         {
             RelayTransaction(tx, inv.hash);
+            vector<uint256> vWorkQueue;
             vWorkQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            ProcessOrphanTxs(vWorkQueue);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, GetMaxOrphanTxSize());
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4276,10 +5261,37 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         // Remember who we got this block from.
         mapBlockSource[inv.hash] = pfrom->GetId();
         MarkBlockAsReceived(inv.hash, pfrom->GetId());
+        UpdateBlockAvailability(pfrom->GetId(), hashBlock);
 
         // NOTE: Demi-node verified reorganize triggers in ProcessBlock()
+        CBlockIndex* pindexPrevBest = pindexBest;
         if (ProcessBlock(pfrom, &block)) mapAlreadyAskedFor.erase(inv);//ProcessBlock(pfrom, &block);
 
+        // The blocks that joined the main chain, this one and any orphan
+        // blocks it let connect, may carry parents of orphan transactions
+        if (!mapOrphanTransactions.empty() && pindexBest != pindexPrevBest)
+        {
+            CBlockIndex* pindexFork = pindexPrevBest;
+            while (pindexFork && !pindexFork->IsInMainChain())
+                pindexFork = pindexFork->pprev;
+
+            vector<uint256> vWorkQueue;
+            for (CBlockIndex* pindex = pindexBest; pindex && pindex != pindexFork; pindex = pindex->pprev)
+            {
+                CBlock blockConnected;
+                const CBlock* pblockConnected = &block;
+                if (pindex->GetBlockHash() != hashBlock)
+                {
+                    if (!blockConnected.ReadFromDisk(pindex))
+                        continue;
+                    pblockConnected = &blockConnected;
+                }
+                BOOST_FOREACH(const CTransaction& txBlock, pblockConnected->vtx)
+                    vWorkQueue.push_back(txBlock.GetHash());
+            }
+            ProcessOrphanTxs(vWorkQueue);
+        }
+
         if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
 
         if (fSecMsgEnabled) {
@@ -4312,7 +5324,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -4449,11 +5464,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
-    else
+    else if (strCommand.compare(0, 4, "smsg") == 0)
     {
         if (fSecMsgEnabled) {
             SecureMsgReceiveData(pfrom, strCommand, vRecv);
         }
+    }
+
+
+    else
+    {
         if (pfrom->nVersion >= MIN_MASTERNODE_BSC_RELAY) {
             mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
             ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
@@ -4549,6 +5569,7 @@ bool ProcessMessages(CNode* pfrom)
         // end, if an incomplete message is found
         if (!msg.complete())
             break;
+        CNode::RecordMessageWait(GetTimeMicros() - msg.nTime);
 
         // at this point, any failure means we can delete the current message
         it++;
@@ -4588,7 +5609,13 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            if (HandlerLocksMain(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
+            {
+                LOCK(cs_main);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            }
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -4686,7 +5713,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->fStartSync = false;
 
             if(!fDemiNodes) {
-                PushGetBlocks(pto, pindexBest, uint256(0));
+                if (GetBoolArg("-headersfirst", false))
+                    PushGetHeaders(pto);
+                else
+                    PushGetBlocks(pto, pindexBest, uint256(0));
             } else {
                 if(pto->nVersion < DEMINODE_VERSION) {
                     // Syncing from legacy peers is no longer supported.
@@ -4724,7 +5754,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4743,25 +5776,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrNew;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddrNew.size(); i += 1000)
+            {
+                vector<CAddress> vAddr(vAddrNew.begin() + i, vAddrNew.begin() + min(i + 1000, (unsigned int)vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -4840,6 +5872,35 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->fDisconnect = true;
         }
 
+        //
+        // Headers-first sync
+        //
+        if (state.nHeadersRequestTime && GetTime() - state.nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT) {
+            // No answer, e.g. a peer in initial download itself: sync the
+            // old way from it
+            LogPrint("net", "peer=%d sent no headers, falling back to getblocks\n", pto->id);
+            state.nHeadersRequestTime = 0;
+            PushGetBlocks(pto, pindexBest, uint256(0));
+        } else if (state.fMoreHeaders && !state.nHeadersRequestTime && mapHeaders.size() < (size_t)MAX_HEADERS_AHEAD / 2) {
+            PushGetHeaders(pto);
+        }
+        TrimHeaderChain();
+        if (!mapHeaders.empty() && GetTime() - nHeaderChainProgress > HEADERS_STALE_TIMEOUT) {
+            // Headers whose blocks nobody sends: forget them, and stop
+            // asking for more until the next sync starts
+            LogPrintf("No blocks of the header chain arrived for %d seconds, dropping %u headers\n",
+                HEADERS_STALE_TIMEOUT, mapHeaders.size());
+            ClearHeaders();
+            for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                it->second.fMoreHeaders = false;
+        }
+        if (!pto->fDisconnect && IsStallingDownload(pto->GetId(), nNow)) {
+            LogPrintf("Peer %s is stalling the block download window, disconnecting\n", state.name.c_str());
+            pto->fDisconnect = true;
+        }
+        if (!pto->fDisconnect && !vHeaderChain.empty())
+            FindBlocksToDownload(pto, state);
+
 
         //
         // Message: getdata (blocks)
@@ -4892,5 +5953,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
     }
-    return true;
+    // cs_main was busy: nothing was sent, try again soon
+    return lockMain;
 }
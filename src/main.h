@@ -18,8 +18,11 @@
 #include "genesis.h"
 #include "mining.h"
 
+#include <atomic>
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CValidationState;
 class CBlock;
 class CBlockIndex;
@@ -51,8 +54,26 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
-/** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 5000;
+/** The largest orphan transaction kept, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer's orphans may use at most 1/ORPHAN_TX_PEER_SHARE of -maxorphantxsize */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 10;
+/** Seconds an orphan transaction is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Default for -maxorphanblocks, maximum number of orphan blocks kept */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 10000;
+/** Default for -maxorphanblocksmem, megabytes of orphan blocks kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY = 20;
+/** Default for -maxorphanblocksdisk, megabytes of orphan blocks spilled to disk */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_DISK = 200;
+/** The orphan block file is compacted once at least 1/n of it is left by blocks taken out */
+static const unsigned int ORPHAN_BLOCKS_COMPACT_RATIO = 4;
+/** Default for -maxmempool, maximum megabytes of transactions kept in the memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 0.0001*COIN;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -71,6 +92,20 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Headers in a full "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers-first sync keeps up to this many headers ahead of the tip */
+static const int MAX_HEADERS_AHEAD = 20000;
+/** Seconds to wait for headers before syncing from a peer with getblocks */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT = 60;
+/** Blocks past the tip that headers-first sync downloads at the same time */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Blocks of the window requested from one peer at a time */
+static const int MAX_HEADERS_FIRST_BLOCKS_PER_PEER = 16;
+/** Seconds a peer may hold up the download window */
+static const int64_t BLOCK_STALLING_TIMEOUT = 10;
+/** Seconds without a block of the header chain before its headers are dropped */
+static const int64_t HEADERS_STALE_TIMEOUT = 5 * 60;
 /** Maximum block reorganize depth (consider else an invalid fork) */
 static const int BLOCK_REORG_MAX_DEPTH = 1;
 /** Maximum block reorganize depth override (enabled using demi-nodes) */
@@ -89,11 +124,25 @@ static const int64_t nDrift = 5 * 60;
 inline int64_t FutureDrift(int64_t nTime) { return nTime + nDrift; }
 /** "reject" message codes **/
 static const unsigned char REJECT_INVALID = 0x10;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads decoding block index records at startup */
+static const int MAX_BLOCKINDEX_DECODE_THREADS = 8;
+/** Maximum number of threads decoding blocks in the block file importer */
+static const int MAX_IMPORT_DECODE_THREADS = 8;
+/** Read-ahead of the block file importer */
+static const size_t IMPORT_READ_BUFFER_SIZE = 16 * 1024 * 1024;
+/** Bytes of blocks the block file importer decodes at once */
+static const size_t IMPORT_BATCH_SIZE = 16 * 1024 * 1024;
+/** Bytes of blocks the block file importer holds for their parent */
+static const uint64_t MAX_IMPORT_PENDING_SIZE = 64 * 1024 * 1024;
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nNodeLifespan;
@@ -109,13 +158,15 @@ extern const std::string strMessageMagic;
 extern std::string GetRelayPeerAddr;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
+extern std::atomic<bool> fMempoolLoaded;
 extern bool fReindex;
-struct COrphanBlock;
-extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
+class COrphanBlockStore;
+extern COrphanBlockStore orphanBlocks;
 extern bool fHaveGUI;
 
 // Settings
 extern bool fUseFastIndex;
+extern int nScriptCheckThreads;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fLargeWorkForkFound;
@@ -125,6 +176,7 @@ extern bool fLargeWorkInvalidChainFound;
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -153,26 +205,67 @@ FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Storage for a new CBlockIndex, to be constructed with placement new.
+ *  Entries are carved out of large chunks so the block index is contiguous
+ *  in memory; like all block index entries they are never freed. */
+void* AllocateBlockIndex();
 bool ProcessMessages(CNode* pfrom);
+/** Returns false if cs_main was busy and the peer has to be visited again */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Save the memory pool to mempool.dat */
+bool DumpMempool();
+/** Accept the transactions in mempool.dat into the memory pool, in batches */
+bool LoadMempool();
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+/** Trust a block with target nBits adds to its chain */
+uint256 GetBlockTrust(unsigned int nBits);
 bool IsInitialBlockDownload();
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
-uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectinsaneFee=false, bool ignoreFees=false, bool fFixSpentCoins=false);
 
+/** Like AcceptToMemoryPool, for callers not holding cs_main: the stateless
+ *  checks run before it is taken and the signatures are verified on the script
+ *  check threads without it; only the input lookup and the insertion lock it. */
+bool AcceptToMemoryPoolConcurrent(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                                  bool* pfMissingInputs, bool fRejectinsaneFee=false, bool ignoreFees=false);
+
 bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectinsaneFee=false, bool isDSTX=false);
 
+/** Stages of memory pool admission */
+enum
+{
+    ADMIT_PRECHECK, // stateless transaction checks
+    ADMIT_INPUTS,   // policy, inputs and fees, under cs_main
+    ADMIT_SCRIPTS,  // signature verification
+    ADMIT_INSERT,   // insertion and eviction, under cs_main
+    ADMIT_STAGE_COUNT
+};
+
+/** Throughput of one admission stage since startup */
+struct CAdmissionStageStats
+{
+    uint64_t nCount;     // passes through the stage
+    uint64_t nRejected;  // passes that rejected the transaction
+    int64_t nTimeMicros; // time spent in the stage
+
+    CAdmissionStageStats() : nCount(0), nRejected(0), nTimeMicros(0) {}
+};
+
+/** Copy the admission stage counters, indexed by ADMIT_* */
+void GetAdmissionStats(std::vector<CAdmissionStageStats>& vStats);
+
 
 bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
 
@@ -185,6 +278,13 @@ bool AbortNode(const std::string &msg, const std::string &userMessage="");
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
+/** Keep a transaction with missing inputs until its parents show up */
+bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+/** Drop the orphan transactions received from a peer */
+void EraseOrphansFor(NodeId peer);
+/** Drop expired orphan transactions, then random ones until at most
+ *  nMaxOrphans using at most nMaxBytes are left. Returns how many went. */
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes);
 
 
 struct CNodeStateStats {
@@ -438,11 +538,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    if non-NULL, script checks are appended here instead of being run inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -452,6 +554,41 @@ public:
 
 
 
+/** Closure representing one script verification.
+ *  Note that this stores references to the spending transaction, so the
+ *  block it belongs to must outlive the check.  The previous transaction is
+ *  shared between all checks for its outputs.
+ */
+class CScriptCheck
+{
+private:
+    boost::shared_ptr<const CTransaction> ptxFrom;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const boost::shared_ptr<const CTransaction>& ptxFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        ptxFrom(ptxFromIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+    /** Report the failure of this check as ConnectInputs() would, DoS score included */
+    bool ReportFailure() const;
+
+    void swap(CScriptCheck &check) {
+        ptxFrom.swap(check.ptxFrom);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
+
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -894,7 +1031,7 @@ public:
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
+    void RebuildAddressIndex(CTxDB& txdb, int nHeight);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -982,6 +1119,8 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
+    // (memory only) serialized size of the block, 0 if not known yet
+    unsigned int nBlockSize;
     // (memory only) Sequencial id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
@@ -1003,6 +1142,7 @@ public:
         prevoutStake.SetNull();
         nStakeTime = 0;
         nSequenceId = 0;
+        nBlockSize = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1027,6 +1167,7 @@ public:
         bnStakeModifierV2 = 0;
         hashProof = 0;
         nSequenceId = 0;
+        nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
@@ -1165,6 +1306,49 @@ public:
 };
 
 
+/** The active chain, from the genesis block to pindexBest, indexed by height.
+ *  Kept in step with pindexBest by SetBestChain and LoadBlockIndex. It has its
+ *  own lock, so height lookups don't need cs_main. */
+class CChain
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the block at the given height, or NULL if there is none. */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        LOCK(cs);
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        LOCK(cs);
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    /** Height of the tip, -1 for an empty chain. */
+    int Height() const
+    {
+        LOCK(cs);
+        return (int)vChain.size() - 1;
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Make pindex the tip; only the entries above the fork point change. */
+    void SetTip(CBlockIndex* pindex);
+};
+
+extern CChain chainActive;
+
 
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
@@ -1283,7 +1467,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1327,6 +1511,12 @@ public:
         vHave.push_back(Params().HashGenesisBlock());
     }
 
+    // Lets headers-first sync continue from the best header it has
+    void PushFront(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     int GetDistanceBack()
     {
         // Retrace how far back it was in the sender's branch
@@ -1334,7 +1524,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1353,7 +1543,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1369,7 +1559,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -38,29 +38,19 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
         return true;
     }
 
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
+    if (pindexBest->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
 
+    // The hash wanted is the one of the block before nBlockHeight
     int nBlocksAgo = 0;
     if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
     assert(nBlocksAgo >= 0);
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex *BlockReading = FindBlockByHeight(pindexBest->nHeight - nBlocksAgo);
+    if (BlockReading == NULL || BlockReading->nHeight == 0) return false;
 
-    return false;
+    hash = BlockReading->GetBlockHash();
+    mapCacheBlockHashes[nBlockHeight] = hash;
+    return true;
 }
 
 CMasternode::CMasternode()
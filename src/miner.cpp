@@ -62,13 +62,15 @@ class COrphan
 {
 public:
     CTransaction* ptx;
+    const CTxMemPoolEntry* pentry;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(CTransaction* ptxIn, const CTxMemPoolEntry* pentryIn)
     {
         ptx = ptxIn;
+        pentry = pentryIn;
         dPriority = dFeePerKb = 0;
     }
 };
@@ -79,7 +81,7 @@ uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, CTransaction*, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -102,6 +104,91 @@ public:
     }
 };
 
+// Results of checking pool transactions against the inputs of the tip they
+// were checked on. For a transaction that only spends chain outputs this
+// cannot change until the tip does, so templates built on the same tip skip
+// fetching and connecting its inputs again. Protected by cs_main.
+static uint256 hashTemplateTip;
+static map<uint256, bool> mapTemplateChecked;
+
+// Mark the outputs tx spends in mapTestPool, as ConnectInputs() would, for a
+// transaction remembered as valid. Fails, leaving mapTestPool alone, if one of
+// them is spent already by a transaction in the template.
+static bool MarkTemplateSpends(CTxDB& txdb, const CTransaction& tx, map<uint256, CTxIndex>& mapTestPool)
+{
+    map<uint256, CTxIndex> mapSpent;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const COutPoint& prevout = txin.prevout;
+        map<uint256, CTxIndex>::iterator mi = mapSpent.find(prevout.hash);
+        if (mi == mapSpent.end())
+        {
+            mi = mapSpent.insert(make_pair(prevout.hash, CTxIndex())).first;
+            map<uint256, CTxIndex>::const_iterator miPool = mapTestPool.find(prevout.hash);
+            if (miPool != mapTestPool.end())
+                mi->second = miPool->second;
+            else if (!txdb.ReadTxIndex(prevout.hash, mi->second))
+                return false;
+        }
+        CTxIndex& txindex = mi->second;
+        if (prevout.n >= txindex.vSpent.size() || !txindex.vSpent[prevout.n].IsNull())
+            return false;
+        txindex.vSpent[prevout.n] = CDiskTxPos(1,1,1);
+    }
+
+    for (map<uint256, CTxIndex>::iterator mi = mapSpent.begin(); mi != mapSpent.end(); ++mi)
+        mapTestPool[mi->first] = mi->second;
+    return true;
+}
+
+// Whether tx connects on top of pindexPrev and the transactions already in
+// the template (mapTestPool)
+static bool CheckTemplateInputs(CTxDB& txdb, CTransaction& tx, const uint256& hash, const CTxMemPoolEntry& entry, CBlockIndex* pindexPrev, map<uint256, CTxIndex>& mapTestPool)
+{
+    bool fRemember = entry.setDependsOn.empty();
+    if (fRemember)
+    {
+        // The script checks are what is saved; the spends still go into
+        // mapTestPool so a conflicting pool transaction is turned away
+        map<uint256, bool>::iterator mi = mapTemplateChecked.find(hash);
+        if (mi != mapTemplateChecked.end())
+            return mi->second && MarkTemplateSpends(txdb, tx, mapTestPool);
+    }
+
+    // ConnectInputs() marks spent outputs in mapTestPool and can fail half
+    // way through; keep the entries it may overwrite instead of copying the
+    // whole test pool for every transaction
+    map<uint256, CTxIndex> mapUndo;
+    set<uint256> setAbsent;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTestPool.find(txin.prevout.hash);
+        if (mi == mapTestPool.end())
+            setAbsent.insert(txin.prevout.hash);
+        else
+            mapUndo.insert(*mi);
+    }
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    bool fValid = tx.FetchInputs(txdb, mapTestPool, false, true, mapInputs, fInvalid) &&
+                  tx.ConnectInputs(txdb, mapInputs, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS);
+    if (!fValid)
+    {
+        BOOST_FOREACH(const uint256& hashPrev, setAbsent)
+            mapTestPool.erase(hashPrev);
+        for (map<uint256, CTxIndex>::iterator mi = mapUndo.begin(); mi != mapUndo.end(); ++mi)
+            mapTestPool[mi->first] = mi->second;
+    }
+
+    if (fRemember)
+        mapTemplateChecked[hash] = fValid;
+    return fValid;
+}
+
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
 {
@@ -188,6 +275,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 //> REV <
+        if (hashTemplateTip != pindexPrev->GetBlockHash())
+        {
+            mapTemplateChecked.clear();
+            hashTemplateTip = pindexPrev->GetBlockHash();
+        }
+
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
@@ -201,58 +294,30 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
                 continue;
 
+            // Priority and fee rate come from what was learnt about the
+            // inputs when the transaction entered the pool
+            map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapEntry.find((*mi).first);
+            if (it == mempool.mapEntry.end())
+                continue;
+            const CTxMemPoolEntry& entry = (*it).second;
+            double dPriority = entry.GetPriority(nHeight);
+            double dFeePerKb = entry.GetFeePerKb();
+
+            // Has to wait for dependencies still in the pool
             COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            BOOST_FOREACH(const uint256& hashDependsOn, entry.setDependsOn)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                if (!mempool.mapTx.count(hashDependsOn))
                     continue;
+                if (!porphan)
+                {
+                    // Use list for automatic deletion
+                    vOrphan.push_back(COrphan(&tx, &entry));
+                    porphan = &vOrphan.back();
                 }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                mapDependers[hashDependsOn].push_back(porphan);
+                porphan->setDependsOn.insert(hashDependsOn);
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
 
             if (porphan)
             {
@@ -260,7 +325,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                 porphan->dFeePerKb = dFeePerKb;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &tx, &entry));
         }
 
         // Collect transactions into block
@@ -279,17 +344,18 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
             CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTxMemPoolEntry& entry = *(vecPriority.front().get<3>());
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = entry.nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+            // Legacy and P2SH limits on sigOps:
+            unsigned int nTxSigOps = entry.nSigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -313,41 +379,25 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueMapIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            uint256 hash = tx.GetHash();
+            if (!CheckTemplateInputs(txdb, tx, hash, entry, pindexPrev, mapTestPool))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+            mapTestPool[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
 
             // Added
             pblock->vtx.push_back(tx);
             nBlockSize += nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            nFees += entry.nFee;
 
             if (fDebug && GetBoolArg("-printpriority", false))
             {
                 LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                       dPriority, dFeePerKb, hash.ToString());
             }
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
             if (mapDependers.count(hash))
             {
                 BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
@@ -357,7 +407,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                         porphan->setDependsOn.erase(hash);
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx, porphan->pentry));
                             std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                         }
                     }
@@ -0,0 +1,152 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgscheduler.h"
+
+#include "util.h"
+
+using namespace std;
+
+CMessageScheduler::CMessageScheduler(int64_t nIntervalMillis, int64_t nRetryMillis)
+{
+    nInterval = nIntervalMillis;
+    nRetryDelay = nRetryMillis;
+    nNextFullPass = 0;
+    fStartingPass = false;
+    idTrickle = -1;
+}
+
+void CMessageScheduler::Wake(NodeId id)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mut);
+        if (!setReady.insert(id).second)
+            return;
+    }
+    cond.notify_one();
+}
+
+bool CMessageScheduler::TakeReady(NodeId& id)
+{
+    for (set<NodeId>::iterator it = setReady.begin(); it != setReady.end(); ++it)
+    {
+        if (setBusy.count(*it))
+            continue;
+        id = *it;
+        setReady.erase(it);
+        setBusy.insert(id);
+        mapRetry.erase(id);
+        return true;
+    }
+    return false;
+}
+
+bool CMessageScheduler::TakeFullPass(NodeId& id)
+{
+    while (!vFullPass.empty())
+    {
+        id = vFullPass.front();
+        vFullPass.pop_front();
+        // A peer being handled gets its turn once it is done
+        if (!setBusy.insert(id).second)
+        {
+            setDeferred.insert(id);
+            continue;
+        }
+        setReady.erase(id);
+        mapRetry.erase(id);
+        return true;
+    }
+    return false;
+}
+
+// Moves the peers whose retry is due to setReady; returns when the next one
+// is, or 0 if none is left
+int64_t CMessageScheduler::ReadyRetries(int64_t nNow)
+{
+    int64_t nNextRetry = 0;
+    for (map<NodeId, int64_t>::iterator it = mapRetry.begin(); it != mapRetry.end(); )
+    {
+        if (it->second <= nNow)
+        {
+            setReady.insert(it->first);
+            mapRetry.erase(it++);
+            continue;
+        }
+        if (!nNextRetry || it->second < nNextRetry)
+            nNextRetry = it->second;
+        ++it;
+    }
+    return nNextRetry;
+}
+
+bool CMessageScheduler::Next(NodeId& id, bool& fTrickle)
+{
+    boost::unique_lock<boost::mutex> lock(mut);
+    while (true)
+    {
+        int64_t nNow = GetTimeMillis();
+        if (!fStartingPass && nNow >= nNextFullPass)
+        {
+            fStartingPass = true;
+            nNextFullPass = nNow + nInterval;
+            return false;
+        }
+
+        int64_t nNextRetry = ReadyRetries(nNow);
+
+        // Woken peers go first, they have messages waiting
+        if (TakeReady(id) || TakeFullPass(id))
+        {
+            fTrickle = (id == idTrickle);
+            if (fTrickle)
+                idTrickle = -1;
+            return true;
+        }
+
+        int64_t nWake = nNextRetry ? min(nNextRetry, nNextFullPass) : nNextFullPass;
+        cond.timed_wait(lock, boost::posix_time::milliseconds(max(nWake - nNow, (int64_t)1)));
+    }
+}
+
+void CMessageScheduler::StartFullPass(const vector<NodeId>& vNodes, NodeId idTrickleIn)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mut);
+        vFullPass.assign(vNodes.begin(), vNodes.end());
+        setDeferred.clear();
+        idTrickle = idTrickleIn;
+        fStartingPass = false;
+    }
+    cond.notify_all();
+}
+
+void CMessageScheduler::Done(NodeId id, bool fMoreWork, bool fRetryLater)
+{
+    bool fNotify;
+    {
+        boost::lock_guard<boost::mutex> lock(mut);
+        setBusy.erase(id);
+        if (fMoreWork)
+            setReady.insert(id);
+        fNotify = setReady.count(id) > 0;
+        // A waiting thread has to learn of the retry to wake up for it
+        if (fRetryLater && !fNotify && !mapRetry.count(id))
+        {
+            mapRetry[id] = GetTimeMillis() + nRetryDelay;
+            fNotify = true;
+        }
+        // Its full pass turn, and the trickle if it was picked, come with
+        // the next time it is handed out
+        if (setDeferred.erase(id) && !fNotify)
+        {
+            vFullPass.push_back(id);
+            fNotify = true;
+        }
+    }
+    // Wakeups that came in while the peer was busy may have left every
+    // other thread asleep
+    if (fNotify)
+        cond.notify_one();
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MSGSCHEDULER_H
+#define MSGSCHEDULER_H
+
+#include "threadsafety.h"
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+typedef int NodeId;
+
+/** Hands peers with work to the message handler threads.
+ *
+ * A peer is given to one thread at a time, so its messages are still handled
+ * in the order they arrived while different peers are handled in parallel.
+ * Peers are handed out when woken, and all of them once per full pass, which
+ * the thread that finds it due collects with StartFullPass(). Wakeups for a
+ * peer that is being handled, and its turn in the full pass, wait until
+ * Done(). A peer that could not be handled for a busy lock comes back after
+ * a delay rather than at once, so threads do not spin on the lock.
+ */
+class CMessageScheduler
+{
+private:
+    boost::mutex mut;
+    boost::condition_variable cond;
+
+    std::set<NodeId> setReady GUARDED_BY(mut);
+    std::set<NodeId> setBusy GUARDED_BY(mut);
+    std::deque<NodeId> vFullPass GUARDED_BY(mut);
+    // Peers whose turn in the full pass came while they were busy
+    std::set<NodeId> setDeferred GUARDED_BY(mut);
+    // Peers to hand out again once their time has come
+    std::map<NodeId, int64_t> mapRetry GUARDED_BY(mut);
+    NodeId idTrickle GUARDED_BY(mut);
+    int64_t nInterval;
+    int64_t nRetryDelay;
+    int64_t nNextFullPass GUARDED_BY(mut);
+    bool fStartingPass GUARDED_BY(mut);
+
+    bool TakeReady(NodeId& id) EXCLUSIVE_LOCKS_REQUIRED(mut);
+    bool TakeFullPass(NodeId& id) EXCLUSIVE_LOCKS_REQUIRED(mut);
+    int64_t ReadyRetries(int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(mut);
+
+public:
+    CMessageScheduler(int64_t nIntervalMillis, int64_t nRetryMillis);
+
+    /** The peer has messages to process or inventory to send */
+    void Wake(NodeId id);
+
+    /** Wait for a peer to handle, with fTrickle set for the one picked to
+     *  trickle to this pass. Returns false instead when a full pass is due;
+     *  the caller then passes all peers to StartFullPass(). Interruptible. */
+    bool Next(NodeId& id, bool& fTrickle);
+
+    void StartFullPass(const std::vector<NodeId>& vNodes, NodeId idTrickleIn);
+
+    /** The thread given id by Next() is finished with it. fRetryLater asks
+     *  for it to be handed out again after the retry delay. */
+    void Done(NodeId id, bool fMoreWork, bool fRetryLater = false);
+};
+
+#endif
@@ -10,12 +10,16 @@
 #include "chain.h"
 #include "ui_interface.h"
 #include "mnengine.h"
+#include "msgscheduler.h"
+#include "relaycache.h"
+#include "socketevents.h"
 #include "wallet.h"
 
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -51,7 +55,8 @@ map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
 static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
-static CNode* pnodeSync = NULL;
+static CCriticalSection cs_pnodeSync;
+static CNode* pnodeSync GUARDED_BY(cs_pnodeSync) = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
@@ -60,9 +65,7 @@ int nMaxConnections = GetArg("-maxconnections", 125);
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -83,6 +86,14 @@ static CSemaphore *semOutbound = NULL;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+// Peers for the ThreadMessageHandler threads to look at
+static CMessageScheduler msgScheduler(MESSAGE_HANDLER_INTERVAL, MESSAGE_HANDLER_RETRY_DELAY);
+
+void WakeMessageHandler(CNode *pnode)
+{
+    msgScheduler.Wake(pnode->GetId());
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -320,6 +331,9 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nTotalMessages = 0;
+int64_t CNode::nTotalMessageWait = 0;
+CCriticalSection CNode::cs_totalMessageWait;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -467,6 +481,7 @@ void CNode::CloseSocketDisconnect()
         vRecvMsg.clear();
 
     // if this was the sync node, we'll need a new one
+    LOCK(cs_pnodeSync);
     if (this == pnodeSync)
         pnodeSync = NULL;
 }
@@ -631,7 +646,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
-    stats.fSyncNode = (this == pnodeSync);
+    {
+        LOCK(cs_pnodeSync);
+        stats.fSyncNode = (this == pnodeSync);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -656,6 +674,7 @@ void CNode::copyStats(CNodeStats &stats)
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -675,10 +694,18 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete()) {
+            msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
+
         pch += handled;
         nBytes -= handled;
     }
 
+    if (fComplete)
+        WakeMessageHandler(this);
+
     return true;
 }
 
@@ -920,26 +947,91 @@ void IdleNodeCheck(CNode *pnode)
     return;
 }
 
+void FinishMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash_bmw512(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << CMessageHeader(pszCommand, 0);
+    if (!ssPayload.empty())
+        ss.write(&ssPayload[0], ssPayload.size());
+    FinishMessage(ss);
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSharedMessage(pdata);
+}
+
+// Hand the queued messages to the socket, as many as it takes in one call
+static int SendQueuedMessages(CNode *pnode, size_t& nWant)
+{
+#ifdef WIN32
+    const CSerializeData &data = *pnode->vSendMsg.front();
+    nWant = data.size() - pnode->nSendOffset;
+    return send(pnode->hSocket, &data[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_IOV];
+    int nIov = 0;
+    nWant = 0;
+    for (std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++it, ++nIov)
+    {
+        const CSerializeData &data = **it;
+        size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+        iov[nIov].iov_base = (void*)&data[nOffset];
+        iov[nIov].iov_len = data.size() - nOffset;
+        nWant += iov[nIov].iov_len;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (!pnode->vSendMsg.empty()) {
+        assert(pnode->vSendMsg.front()->size() > pnode->nSendOffset);
+        size_t nWant = 0;
+        int nBytes = SendQueuedMessages(pnode, nWant);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Drop what went out; the buffers go once no other peer holds them
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const CSerializeData &data = *pnode->vSendMsg.front();
+                size_t nRest = data.size() - pnode->nSendOffset;
+                if (nLeft < nRest) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRest;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->vSendMsg.pop_front();
+            }
+
+            if ((size_t)nBytes < nWant) {
+                // could not send everything; stop sending more
                 LogPrintf("socket send error: interruption\n");
                 IdleNodeCheck(pnode);
                 break;
@@ -952,23 +1044,74 @@ void SocketSendData(CNode *pnode)
               break;
             }
 
-            pnode->CloseSocketDisconnect();
+            // the socket buffer is full; wait until it is writable again
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                LogPrintf("socket send error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
             break;
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+// Implement the following logic:
+// * If there is data to send, wait for sending data. As this only
+//   happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, wait for receiving data.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+static void GetSocketInterest(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    fWantSend = false;
+    fWantRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+
+    // Listening sockets are there from the start and never change
+    CSocketEvents events(GetBoolArg("-epoll", true));
+    if (events.IsEdgeTriggered())
+    {
+        LogPrintf("Using epoll for network sockets\n");
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            events.Add(hListenSocket, NULL, true);
+    }
+    bool fMoreWork = false;
+
     while (true)
     {
         //
@@ -1036,141 +1179,126 @@ void ThreadSocketHandler()
 
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
+        vector<CSocketEvents::CEvent> vWanted;
+        vector<CSocketEvents::CEvent> vReady;
+        if (events.IsEdgeTriggered())
+        {
+            // Sockets are watched from when their node appears until they
+            // are closed
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                pnode->fSocketRegistered = true;
+                if (!events.Add(pnode->hSocket, pnode, false))
+                    pnode->fDisconnect = true;
+                // Try it once instead of waiting for the first edge
+                pnode->fSocketReadable = true;
+                pnode->fSocketWritable = true;
+            }
         }
+        else
         {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                vWanted.push_back(CSocketEvents::CEvent(hListenSocket, NULL, CSocketEvents::SOCKET_RECV));
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+                bool fWantSend, fWantRecv;
+                GetSocketInterest(pnode, fWantSend, fWantRecv);
+                vWanted.push_back(CSocketEvents::CEvent(pnode->hSocket, pnode,
+                    (fWantSend ? CSocketEvents::SOCKET_SEND : 0) | (fWantRecv ? CSocketEvents::SOCKET_RECV : 0)));
+                pnode->fSocketReadable = false;
+                pnode->fSocketWritable = false;
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        // Come back at once while sockets have data left over, and every
+        // 50ms to poll pnode->vSend otherwise
+        events.Wait(vWanted, fMoreWork ? 0 : 50, vReady);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        bool fListenReady = false;
+        BOOST_FOREACH(const CSocketEvents::CEvent& ready, vReady)
         {
-            if (have_fds)
+            CNode* pnode = (CNode*)ready.pdata;
+            if (pnode == NULL)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                fListenReady = true;
+                continue;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            // A hang-up or error shows as a failing recv
+            if (ready.nEvents & (CSocketEvents::SOCKET_RECV | CSocketEvents::SOCKET_ERROR_EVENT))
+                pnode->fSocketReadable = true;
+            if (ready.nEvents & CSocketEvents::SOCKET_SEND)
+                pnode->fSocketWritable = true;
         }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        // Listening sockets are non-blocking, so the ones without a
+        // connection waiting just fail with WSAEWOULDBLOCK
+        if (fListenReady)
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            if (hListenSocket != INVALID_SOCKET)
+            {
+                struct sockaddr_storage sockaddr;
+                socklen_t len = sizeof(sockaddr);
+                SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+                CAddress addr;
+                int nInbound = 0;
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
+                if (hSocket != INVALID_SOCKET)
+                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+                        LogPrintf("Warning: Unknown socket family\n");
 
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                // According to the internet TCP_NODELAY is not carried into accepted sockets
-                // on all platforms.  Set it again here just to be sure.
-                int set = 1;
+                {
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vNodes)
+                        if (pnode->fInbound)
+                            nInbound++;
+                }
+                if (hSocket == INVALID_SOCKET)
+                {
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK)
+                        LogPrintf("socket error accept failed: %d\n", nErr);
+                }
+                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+                {
+                    closesocket(hSocket);
+                }
+                else if (CNode::IsBanned(addr))
+                {
+                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+                    closesocket(hSocket);
+                }
+                else
+                {
+                    // According to the internet TCP_NODELAY is not carried into accepted sockets
+                    // on all platforms.  Set it again here just to be sure.
+                    int set = 1;
 #ifdef WIN32
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
+                    setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
 #else
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
+                    setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
 #endif
 
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    LogPrint("net", "accepted connection %s\n", addr.ToString());
+                    CNode* pnode = new CNode(hSocket, addr, "", true);
+                    pnode->AddRef();
+                    {
+                        LOCK(cs_vNodes);
+                        vNodes.push_back(pnode);
+                    }
                 }
             }
         }
@@ -1186,16 +1314,29 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        fMoreWork = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
 
+            // select() only reports what we asked for; epoll reports all,
+            // so choose here
+            bool fRecv = pnode->fSocketReadable;
+            bool fSend = pnode->fSocketWritable;
+            if (events.IsEdgeTriggered())
+            {
+                bool fWantSend, fWantRecv;
+                GetSocketInterest(pnode, fWantSend, fWantRecv);
+                fRecv = fRecv && fWantRecv;
+                fSend = fSend && fWantSend;
+            }
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (fRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1209,6 +1350,10 @@ void ThreadSocketHandler()
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // A short read emptied the socket; a full one may
+                        // have left more, which no new edge will announce
+                        pnode->fSocketReadable = (nBytes == (int)sizeof(pchBuf));
+                        fMoreWork |= pnode->fSocketReadable;
                         if (nBytes > 0)
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
@@ -1244,11 +1389,21 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (fSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
+                    // The handler leaves peers alone while their send
+                    // buffer is full; tell it when there is room again
+                    bool fWasFull = pnode->nSendSize >= SendBufferSize();
                     SocketSendData(pnode);
+                    if (fWasFull && pnode->nSendSize < SendBufferSize())
+                        WakeMessageHandler(pnode);
+                    // Left over data means the send would block
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                }
             }
 
             //
@@ -1767,94 +1922,137 @@ void static StartSync(const vector<CNode*> &vNodes) {
     // if a new sync candidate was found, start sync!
     if (pnodeNewSync) {
         pnodeNewSync->fStartSync = true;
+        LOCK(cs_pnodeSync);
         pnodeSync = pnodeNewSync;
     }
 }
 
-void ThreadMessageHandler()
+// Process the messages of one peer and send it what is due; returns whether
+// it has work left that could be done right away. fContended is set when a
+// lock was busy and the peer is worth another try in a moment.
+static bool HandleNode(CNode* pnode, bool fTrickle, bool& fContended)
 {
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true)
-    {
-        bool fHaveSyncNode = false;
-
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
-            }
-        }
-
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    if (pnode->fDisconnect)
+        return false;
 
-        bool fSleep = true;
+    bool fMoreWork = false;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            if (pnode->fDisconnect)
-                continue;
+            if (!g_signals.ProcessMessages(pnode))
+            {
+                pnode->CloseSocketDisconnect();
+            }
 
-            // Receive messages
+            // Disconnect node/peer if send/recv data becomes idle
+            if (GetTime() - pnode->nTimeConnected > 90)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (GetTime() - pnode->nLastRecv > 60)
                 {
-                    if (!g_signals.ProcessMessages(pnode))
+                    if (GetTime() - pnode->nLastSend < 30)
                     {
+                        LogPrintf("Error: Unexpected idle interruption %s\n", pnode->addrName);
                         pnode->CloseSocketDisconnect();
                     }
+                }
+            }
 
-                    // Disconnect node/peer if send/recv data becomes idle
-                    if (GetTime() - pnode->nTimeConnected > 90)
-                    {
-                        if (GetTime() - pnode->nLastRecv > 60)
-                        {
-                            if (GetTime() - pnode->nLastSend < 30)
-                            {
-                                LogPrintf("Error: Unexpected idle interruption %s\n", pnode->addrName);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMoreWork = true;
                 }
             }
-            boost::this_thread::interruption_point();
+        }
+        else
+            fContended = true;
+    }
+    boost::this_thread::interruption_point();
 
-            // Send messages
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (!g_signals.SendMessages(pnode, fTrickle).get_value_or(true))
+                fContended = true;
+        }
+        else
+            fContended = true;
+    }
+    boost::this_thread::interruption_point();
+
+    return fMoreWork;
+}
+
+void ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        NodeId id;
+        bool fTrickle = false;
+        if (!msgScheduler.Next(id, fTrickle))
+        {
+            // Every MESSAGE_HANDLER_INTERVAL all peers are visited, for
+            // syncing, trickling and timeouts; in between only those that
+            // were woken.
+            vector<CNode*> vNodesCopy;
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
             }
-            boost::this_thread::interruption_point();
+            bool fHaveSyncNode;
+            {
+                LOCK(cs_pnodeSync);
+                fHaveSyncNode = (find(vNodesCopy.begin(), vNodesCopy.end(), pnodeSync) != vNodesCopy.end());
+            }
+
+            if (!fHaveSyncNode)
+                StartSync(vNodesCopy);
+
+            vector<NodeId> vIds;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                vIds.push_back(pnode->GetId());
+            NodeId idTrickle = vIds.empty() ? -1 : vIds[GetRand(vIds.size())];
+
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+
+            msgScheduler.StartFullPass(vIds, idTrickle);
+            continue;
         }
 
+        CNode* pnode = NULL;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH(CNode* pnodeTry, vNodes) {
+                if (pnodeTry->GetId() == id) {
+                    pnode = pnodeTry;
+                    pnode->AddRef();
+                    break;
+                }
+            }
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        bool fMoreWork = false;
+        bool fContended = false;
+        if (pnode)
+        {
+            fMoreWork = HandleNode(pnode, fTrickle, fContended);
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        msgScheduler.Done(id, fMoreWork, fContended);
     }
 }
 
@@ -2072,7 +2270,10 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMsgHandlerThreads = GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
+    nMsgHandlerThreads = max(1, min(nMsgHandlerThreads, MAX_MSGHANDLER_THREADS));
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpData, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -2140,19 +2341,10 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    // Keep the original serialized message so newer versions are preserved,
+    // ready for the peers that ask for it
+    relayCache.Put(inv, MakeSharedMessage("tx", ss));
 
     RelayInventory(inv);
 }
@@ -2161,6 +2353,10 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CSharedMessage msg = MakeSharedMessage("txlreq", ss);
+
     //broadcast the new lock
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -2168,7 +2364,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushSharedMessage(msg);
     }
 
 }
@@ -2197,6 +2393,20 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordMessageWait(int64_t nMicros)
+{
+    LOCK(cs_totalMessageWait);
+    nTotalMessages++;
+    nTotalMessageWait += nMicros;
+}
+
+void CNode::GetTotalMessageWait(uint64_t& nMessages, int64_t& nMicros)
+{
+    LOCK(cs_totalMessageWait);
+    nMessages = nTotalMessages;
+    nMicros = nTotalMessageWait;
+}
+
 //
 // CAddrDB
 //
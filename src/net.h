@@ -10,6 +10,7 @@
 #include "hash.h"
 #include "limitedmap.h"
 #include "mruset.h"
+#include "msgscheduler.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "sync.h"
@@ -25,6 +26,7 @@
 
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -57,6 +59,18 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Milliseconds between message handler passes over all peers; woken peers are handled at once */
+static const int64_t MESSAGE_HANDLER_INTERVAL = 100;
+/** Milliseconds before a peer skipped for a busy lock is handled again */
+static const int64_t MESSAGE_HANDLER_RETRY_DELAY = 25;
+/** Most queued messages handed to the socket in one send */
+static const int MAX_SEND_IOV = 64;
+/** Default for -relaycachesize, megabytes of blocks and transactions kept ready to send */
+static const unsigned int DEFAULT_RELAY_CACHE_SIZE = 32;
+/** Default number of message handler threads; each handles a different peer */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -77,7 +91,19 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
-typedef int NodeId;
+/** A complete message, header included. It is never modified once made, so
+ *  one buffer can be queued to any number of peers without copying it. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Fill in the size and checksum of the message ss holds, header first */
+void FinishMessage(CDataStream& ss);
+/** Make a message out of a payload that is already serialized, e.g. to relay
+ *  it to many peers while serializing and hashing it once */
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+/** Have a ThreadMessageHandler thread look at pnode, which has messages to
+ *  process or inventory to send, instead of waiting for the next pass over
+ *  all peers */
+void WakeMessageHandler(CNode *pnode);
 
 // Signals for message handling
 struct CNodeSignals
@@ -141,9 +167,6 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -202,11 +225,14 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    int64_t nTime;                  // time (in usec) the message was complete
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nTime = 0;
     }
 
     bool complete() const
@@ -322,11 +348,16 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg GUARDED_BY(cs_vSend);
     CCriticalSection cs_vSend;
+    // Readiness of hSocket as last seen by ThreadSocketHandler, which alone
+    // uses these. With epoll it lasts until a recv or send would block.
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fSocketRegistered;
 
     std::deque<CInv> vRecvGetData;
-    std::deque<CNetMessage> vRecvMsg;
+    std::deque<CNetMessage> vRecvMsg GUARDED_BY(cs_vRecvMsg);
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
@@ -378,15 +409,16 @@ public:
     bool fStartSync;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrKnown);
+    mruset<CAddress> setAddrKnown GUARDED_BY(cs_addrKnown);
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    mruset<CInv> setInventoryKnown GUARDED_BY(cs_inventory);
+    std::vector<CInv> vInventoryToSend GUARDED_BY(cs_inventory);
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -429,6 +461,9 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fSocketRegistered = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -471,6 +506,9 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CCriticalSection cs_totalMessageWait;
+    static uint64_t nTotalMessages;
+    static int64_t nTotalMessageWait;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -521,6 +559,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -529,6 +568,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -551,9 +591,11 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            vInventoryToSend.push_back(inv);
         }
+        WakeMessageHandler(this);
     }
 
     void AskFor(const CInv& inv)
@@ -627,28 +669,34 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        FinishMessage(ssSend);
 
-        // Set the checksum
-        uint256 hash = Hash_bmw512(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        CSerializeData* pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        QueueMessage(CSharedMessage(pdata));
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSharedMessage& msg) EXCLUSIVE_LOCKS_REQUIRED(cs_vSend)
+    {
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    /** Queue a message made by MakeSharedMessage(), sharing its buffer */
+    void PushSharedMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
+        QueueMessage(msg);
     }
 
     void PushVersion();
@@ -920,6 +968,10 @@ template<typename T1, typename T2, typename T3, typename T4, typename T5, typena
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // How long received messages waited for the message handler
+    static void RecordMessageWait(int64_t nMicros);
+    static void GetTotalMessageWait(uint64_t& nMessages, int64_t& nMicros);
 };
 
 inline void RelayInventory(const CInv& inv)
@@ -0,0 +1,321 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "orphanblocks.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+COrphanBlockStore::COrphanBlockStore()
+{
+    nMaxBlocks = DEFAULT_MAX_ORPHAN_BLOCKS;
+    nMaxMemoryBytes = (uint64_t)DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY * 1000000;
+    nMaxDiskBytes = (uint64_t)DEFAULT_MAX_ORPHAN_BLOCKS_DISK * 1000000;
+    nMemoryBytes = 0;
+    nDiskBytes = 0;
+    file = NULL;
+    nFileSize = 0;
+}
+
+COrphanBlockStore::~COrphanBlockStore()
+{
+    Clear();
+}
+
+void COrphanBlockStore::SetLimits(unsigned int nMaxBlocksIn, uint64_t nMaxMemoryBytesIn, uint64_t nMaxDiskBytesIn)
+{
+    nMaxBlocks = nMaxBlocksIn;
+    nMaxMemoryBytes = nMaxMemoryBytesIn;
+    nMaxDiskBytes = nMaxDiskBytesIn;
+}
+
+// Move the spilled blocks down over the holes left by blocks taken out,
+// in file order, so no block is overwritten before it has been moved.
+bool COrphanBlockStore::Compact()
+{
+    vector<pair<long, COrphanBlock*> > vSpilled;
+    for (map<uint256, COrphanBlock*>::iterator it = mapBlocks.begin(); it != mapBlocks.end(); ++it)
+        if (it->second->nFilePos >= 0)
+            vSpilled.push_back(make_pair(it->second->nFilePos, it->second));
+    sort(vSpilled.begin(), vSpilled.end());
+
+    long nPos = 0;
+    std::vector<unsigned char> vchBlock;
+    for (unsigned int i = 0; i < vSpilled.size(); i++)
+    {
+        COrphanBlock* pblock = vSpilled[i].second;
+        if (pblock->nFilePos != nPos)
+        {
+            vchBlock.resize(pblock->nSize);
+            if (fseek(file, pblock->nFilePos, SEEK_SET) != 0 ||
+                fread(&vchBlock[0], 1, pblock->nSize, file) != pblock->nSize ||
+                fseek(file, nPos, SEEK_SET) != 0 ||
+                fwrite(&vchBlock[0], 1, pblock->nSize, file) != pblock->nSize)
+                return error("COrphanBlockStore::Compact() : moving %s failed", pblock->hashBlock.ToString());
+            pblock->nFilePos = nPos;
+        }
+        nPos += pblock->nSize;
+    }
+
+    LogPrint("net", "COrphanBlockStore::Compact() : %d bytes to %d\n", nFileSize, nPos);
+    nFileSize = nPos;
+    return true;
+}
+
+bool COrphanBlockStore::Spill(COrphanBlock* pblock)
+{
+    if (nDiskBytes + pblock->nSize > nMaxDiskBytes)
+        return false;
+
+    // The file is full of holes: compact it, unless that frees too little
+    // to be worth rewriting the file for
+    if ((uint64_t)nFileSize + pblock->nSize > nMaxDiskBytes)
+    {
+        if ((uint64_t)nFileSize - nDiskBytes < (uint64_t)nFileSize / ORPHAN_BLOCKS_COMPACT_RATIO || !Compact())
+            return false;
+    }
+
+    if (!file)
+    {
+        pathFile = GetDataDir() / "orphanblocks.dat";
+        file = fopen(pathFile.string().c_str(), "w+b");
+        if (!file)
+            return error("COrphanBlockStore::Spill() : cannot create %s", pathFile.string());
+        nFileSize = 0;
+    }
+    if (fseek(file, nFileSize, SEEK_SET) != 0 ||
+        fwrite(&pblock->vchBlock[0], 1, pblock->nSize, file) != pblock->nSize)
+        return error("COrphanBlockStore::Spill() : write failed");
+
+    pblock->nFilePos = nFileSize;
+    nFileSize += pblock->nSize;
+    nDiskBytes += pblock->nSize;
+    std::vector<unsigned char>().swap(pblock->vchBlock);
+    return true;
+}
+
+void COrphanBlockStore::Erase(COrphanBlock* pblock)
+{
+    pair<multimap<uint256, COrphanBlock*>::iterator, multimap<uint256, COrphanBlock*>::iterator> range = mapBlocksByPrev.equal_range(pblock->hashPrev);
+    for (multimap<uint256, COrphanBlock*>::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == pblock)
+        {
+            mapBlocksByPrev.erase(it);
+            break;
+        }
+    }
+    mapBlocks.erase(pblock->hashBlock);
+    setStakeSeen.erase(pblock->stake);
+
+    if (pblock->nFilePos < 0)
+        nMemoryBytes -= pblock->nSize;
+    else
+        nDiskBytes -= pblock->nSize;
+    delete pblock;
+
+    // Start the file over once nothing in it is needed any more
+    if (file && nDiskBytes == 0)
+    {
+        fclose(file);
+        file = NULL;
+        nFileSize = 0;
+        boost::filesystem::remove(pathFile);
+    }
+}
+
+// Remove a random orphan block (which does not have any dependent orphans).
+void COrphanBlockStore::PruneOne()
+{
+    // Pick a random orphan block.
+    int pos = insecure_rand() % mapBlocksByPrev.size();
+    multimap<uint256, COrphanBlock*>::iterator it = mapBlocksByPrev.begin();
+    while (pos--) it++;
+
+    // As long as this block has other orphans depending on it, move to one of those successors.
+    do {
+        multimap<uint256, COrphanBlock*>::iterator it2 = mapBlocksByPrev.find(it->second->hashBlock);
+        if (it2 == mapBlocksByPrev.end())
+            break;
+        it = it2;
+    } while(1);
+
+    Erase(it->second);
+}
+
+// Drop a random orphan held in memory, one without orphan children if there
+// is one; false if all are on disk
+bool COrphanBlockStore::PruneOneInMemory()
+{
+    vector<COrphanBlock*> vLeaves, vOthers;
+    for (map<uint256, COrphanBlock*>::iterator it = mapBlocks.begin(); it != mapBlocks.end(); ++it)
+        if (it->second->nFilePos < 0)
+            (mapBlocksByPrev.count(it->first) ? vOthers : vLeaves).push_back(it->second);
+    vector<COrphanBlock*>& vCandidates = vLeaves.empty() ? vOthers : vLeaves;
+    if (vCandidates.empty())
+        return false;
+    Erase(vCandidates[insecure_rand() % vCandidates.size()]);
+    return true;
+}
+
+bool COrphanBlockStore::Add(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    if (mapBlocks.count(hash))
+        return false;
+
+    while (!mapBlocks.empty() && mapBlocks.size() >= nMaxBlocks)
+        PruneOne();
+    if (nMaxBlocks == 0)
+        return false;
+
+    COrphanBlock* pblock = new COrphanBlock();
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block;
+        pblock->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
+    }
+    pblock->hashBlock = hash;
+    pblock->hashPrev = block.hashPrevBlock;
+    pblock->stake = block.GetProofOfStake();
+    pblock->nSize = pblock->vchBlock.size();
+    pblock->nFilePos = -1;
+
+    // Past the memory budget the block goes to disk; past that too, others
+    // in memory make room. Dropping spilled ones would free no memory.
+    if (nMemoryBytes + pblock->nSize > nMaxMemoryBytes && !Spill(pblock))
+    {
+        while (nMemoryBytes + pblock->nSize > nMaxMemoryBytes && PruneOneInMemory())
+            ;
+    }
+    if (pblock->nFilePos < 0)
+        nMemoryBytes += pblock->nSize;
+
+    // Join the chain of the parent, if that is an orphan too
+    map<uint256, COrphanBlock*>::iterator itPrev = mapBlocks.find(pblock->hashPrev);
+    pblock->hashRoot = (itPrev == mapBlocks.end()) ? hash : itPrev->second->hashRoot;
+
+    mapBlocks.insert(make_pair(hash, pblock));
+    mapBlocksByPrev.insert(make_pair(pblock->hashPrev, pblock));
+    if (block.IsProofOfStake())
+        setStakeSeen.insert(pblock->stake);
+
+    // Orphans that arrived before this block now hang off the same root
+    if (mapBlocksByPrev.count(hash))
+    {
+        vector<uint256> vWorkQueue;
+        vWorkQueue.push_back(hash);
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            pair<multimap<uint256, COrphanBlock*>::iterator, multimap<uint256, COrphanBlock*>::iterator> range = mapBlocksByPrev.equal_range(vWorkQueue[i]);
+            for (multimap<uint256, COrphanBlock*>::iterator it = range.first; it != range.second; ++it)
+            {
+                it->second->hashRoot = pblock->hashRoot;
+                vWorkQueue.push_back(it->second->hashBlock);
+            }
+        }
+    }
+    return true;
+}
+
+uint256 COrphanBlockStore::GetRoot(const uint256& hash) const
+{
+    map<uint256, COrphanBlock*>::const_iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return hash;
+    if (mapBlocks.count(it->second->hashRoot))
+        return it->second->hashRoot;
+
+    // Work back to the first block in the orphan chain
+    do {
+        map<uint256, COrphanBlock*>::const_iterator it2 = mapBlocks.find(it->second->hashPrev);
+        if (it2 == mapBlocks.end())
+            return it->first;
+        it = it2;
+    } while(true);
+}
+
+uint256 COrphanBlockStore::GetWanted(const uint256& hash) const
+{
+    map<uint256, COrphanBlock*>::const_iterator it = mapBlocks.find(GetRoot(hash));
+    if (it == mapBlocks.end())
+        return hash;
+    return it->second->hashPrev;
+}
+
+void COrphanBlockStore::GetChildren(const uint256& hashPrev, std::vector<uint256>& vChildren) const
+{
+    vChildren.clear();
+    pair<multimap<uint256, COrphanBlock*>::const_iterator, multimap<uint256, COrphanBlock*>::const_iterator> range = mapBlocksByPrev.equal_range(hashPrev);
+    for (multimap<uint256, COrphanBlock*>::const_iterator it = range.first; it != range.second; ++it)
+        vChildren.push_back(it->second->hashBlock);
+}
+
+bool COrphanBlockStore::Take(const uint256& hash, CBlock& block)
+{
+    map<uint256, COrphanBlock*>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return false;
+    COrphanBlock* pblock = it->second;
+
+    bool fRead = true;
+    std::vector<unsigned char> vchBlock;
+    if (pblock->nFilePos < 0)
+        vchBlock.swap(pblock->vchBlock);
+    else
+    {
+        vchBlock.resize(pblock->nSize);
+        fRead = (fseek(file, pblock->nFilePos, SEEK_SET) == 0 &&
+                 fread(&vchBlock[0], 1, pblock->nSize, file) == pblock->nSize);
+    }
+    Erase(pblock);
+    if (!fRead)
+        return error("COrphanBlockStore::Take() : read of %s failed", hash.ToString());
+
+    try {
+        CDataStream ss(vchBlock, SER_DISK, CLIENT_VERSION);
+        ss >> block;
+    }
+    catch (std::exception &e) {
+        return error("COrphanBlockStore::Take() : deserialize of %s failed", hash.ToString());
+    }
+    return true;
+}
+
+void COrphanBlockStore::EraseDescendants(const uint256& hashPrev)
+{
+    vector<uint256> vWorkQueue;
+    vWorkQueue.push_back(hashPrev);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        multimap<uint256, COrphanBlock*>::iterator it;
+        while ((it = mapBlocksByPrev.find(vWorkQueue[i])) != mapBlocksByPrev.end())
+        {
+            vWorkQueue.push_back(it->second->hashBlock);
+            Erase(it->second);
+        }
+    }
+}
+
+void COrphanBlockStore::Clear()
+{
+    for (map<uint256, COrphanBlock*>::iterator it = mapBlocks.begin(); it != mapBlocks.end(); ++it)
+        delete it->second;
+    mapBlocks.clear();
+    mapBlocksByPrev.clear();
+    setStakeSeen.clear();
+    nMemoryBytes = 0;
+    nDiskBytes = 0;
+    if (file)
+    {
+        fclose(file);
+        file = NULL;
+        nFileSize = 0;
+        boost::filesystem::remove(pathFile);
+    }
+}
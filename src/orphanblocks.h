@@ -0,0 +1,98 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ORPHANBLOCKS_H
+#define ORPHANBLOCKS_H
+
+#include "chain.h"
+
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class CBlock;
+
+/** Blocks whose parent we do not have yet, indexed by that parent.
+ *
+ * Blocks are kept serialized, in memory up to a byte budget and appended to
+ * orphanblocks.dat in the data directory beyond it, which is kept within a
+ * budget of its own. Blocks taken out leave holes in the file; when it is
+ * full, it is compacted if that frees enough, and emptied as soon as no
+ * spilled block is left. Every block remembers the first block of
+ * the orphan chain it is on, so the block to ask for next is found without
+ * walking the chain. When the store is full, random blocks without orphan
+ * children are dropped, as peers will announce them again.
+ *
+ * Not thread safe; the store in main.cpp is guarded by cs_main.
+ */
+class COrphanBlockStore
+{
+private:
+    struct COrphanBlock
+    {
+        uint256 hashBlock;
+        uint256 hashPrev;
+        uint256 hashRoot;                          // first orphan of the chain
+        std::pair<COutPoint, unsigned int> stake;  // null for proof-of-work
+        unsigned int nSize;
+        std::vector<unsigned char> vchBlock;       // empty once spilled
+        long nFilePos;                             // -1 while in memory
+    };
+
+    std::map<uint256, COrphanBlock*> mapBlocks;
+    std::multimap<uint256, COrphanBlock*> mapBlocksByPrev;
+    std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
+
+    unsigned int nMaxBlocks;
+    uint64_t nMaxMemoryBytes;
+    uint64_t nMaxDiskBytes;
+
+    uint64_t nMemoryBytes;
+    uint64_t nDiskBytes;   // spilled blocks still in the store
+    boost::filesystem::path pathFile;
+    FILE* file;
+    long nFileSize;        // including blocks taken out since
+
+    bool Spill(COrphanBlock* pblock);
+    bool Compact();
+    void Erase(COrphanBlock* pblock);
+    void PruneOne();
+    bool PruneOneInMemory();
+
+public:
+    COrphanBlockStore();
+    ~COrphanBlockStore();
+
+    void SetLimits(unsigned int nMaxBlocksIn, uint64_t nMaxMemoryBytesIn, uint64_t nMaxDiskBytesIn);
+
+    size_t size() const { return mapBlocks.size(); }
+    uint64_t GetMemoryUsage() const { return nMemoryBytes; }
+    uint64_t GetDiskUsage() const { return nDiskBytes; }
+
+    bool Has(const uint256& hash) const { return mapBlocks.count(hash) > 0; }
+    bool HasChildren(const uint256& hash) const { return mapBlocksByPrev.count(hash) > 0; }
+    bool HasStake(const std::pair<COutPoint, unsigned int>& stake) const { return setStakeSeen.count(stake) > 0; }
+
+    /** Store a block whose parent is missing; false if it is already here */
+    bool Add(const CBlock& block);
+
+    /** First block of the orphan chain hash is on, or hash if it is no orphan */
+    uint256 GetRoot(const uint256& hash) const;
+    /** The missing block the orphan chain hash is on waits for */
+    uint256 GetWanted(const uint256& hash) const;
+
+    /** Orphans whose parent is hashPrev */
+    void GetChildren(const uint256& hashPrev, std::vector<uint256>& vChildren) const;
+    /** Remove an orphan from the store, reading it back from disk if needed */
+    bool Take(const uint256& hash, CBlock& block);
+    /** Drop every orphan descending from hashPrev, e.g. once it turned out invalid */
+    void EraseDescendants(const uint256& hashPrev);
+
+    void Clear();
+};
+
+#endif
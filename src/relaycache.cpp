@@ -0,0 +1,87 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+
+using namespace std;
+
+CRelayCache::CRelayCache()
+{
+    nMaxBytes = (size_t)DEFAULT_RELAY_CACHE_SIZE * 1000000;
+    nBytes = 0;
+}
+
+void CRelayCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+size_t CRelayCache::size() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+size_t CRelayCache::GetBytes() const
+{
+    LOCK(cs);
+    return nBytes;
+}
+
+void CRelayCache::EraseEntry(map<CInv, EntryList::iterator>::iterator it)
+{
+    nBytes -= it->second->second->size();
+    listEntries.erase(it->second);
+    mapEntries.erase(it);
+}
+
+void CRelayCache::Trim()
+{
+    while (nBytes > nMaxBytes)
+        EraseEntry(mapEntries.find(listEntries.back().first));
+}
+
+bool CRelayCache::Get(const CInv& inv, CSharedMessage& msg)
+{
+    LOCK(cs);
+    map<CInv, EntryList::iterator>::iterator it = mapEntries.find(inv);
+    if (it == mapEntries.end())
+        return false;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    msg = it->second->second;
+    return true;
+}
+
+void CRelayCache::Put(const CInv& inv, const CSharedMessage& msg)
+{
+    LOCK(cs);
+    map<CInv, EntryList::iterator>::iterator it = mapEntries.find(inv);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+    if (msg->size() > nMaxBytes)
+        return;
+
+    listEntries.push_front(make_pair(inv, msg));
+    mapEntries.insert(make_pair(inv, listEntries.begin()));
+    nBytes += msg->size();
+    Trim();
+}
+
+void CRelayCache::Erase(const CInv& inv)
+{
+    LOCK(cs);
+    map<CInv, EntryList::iterator>::iterator it = mapEntries.find(inv);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CRelayCache::Clear()
+{
+    LOCK(cs);
+    listEntries.clear();
+    mapEntries.clear();
+    nBytes = 0;
+}
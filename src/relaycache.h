@@ -0,0 +1,53 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef RELAYCACHE_H
+#define RELAYCACHE_H
+
+#include "net.h"
+#include "protocol.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+
+/** Blocks and transactions recently sent to peers, as complete messages.
+ *
+ * Every peer that asks for an item gets the same buffer, so it is read from
+ * disk and serialized once however many peers ask for it, as they all do
+ * for a new tip. The least recently used items are dropped to stay within a
+ * byte budget. Thread safe.
+ */
+class CRelayCache
+{
+private:
+    typedef std::list<std::pair<CInv, CSharedMessage> > EntryList;
+
+    mutable CCriticalSection cs;
+    EntryList listEntries GUARDED_BY(cs);   // most recently used first
+    std::map<CInv, EntryList::iterator> mapEntries GUARDED_BY(cs);
+    size_t nMaxBytes GUARDED_BY(cs);
+    size_t nBytes GUARDED_BY(cs);
+
+    void EraseEntry(std::map<CInv, EntryList::iterator>::iterator it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void Trim() EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+public:
+    CRelayCache();
+
+    void SetMaxBytes(size_t nMaxBytesIn);
+
+    size_t size() const;
+    size_t GetBytes() const;
+
+    bool Get(const CInv& inv, CSharedMessage& msg);
+    /** Keep msg as the message for inv, unless it alone exceeds the budget */
+    void Put(const CInv& inv, const CSharedMessage& msg);
+    void Erase(const CInv& inv);
+    void Clear();
+};
+
+extern CRelayCache relayCache;
+
+#endif
@@ -198,10 +198,44 @@ Value getdifficulty(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose true, returns an object per transaction, oldest first, with its\n"
+            "size, fee, entry time, pool parents and ancestor and descendant totals.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        Object o;
+        BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, mempool.setByTime)
+        {
+            const uint256& hash = item.second;
+            const CTxMemPoolEntry& entry = mempool.mapEntry[hash];
+            Object info;
+            info.push_back(Pair("size", (int)entry.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(entry.nFee)));
+            info.push_back(Pair("time", entry.nTime));
+            info.push_back(Pair("ancestorcount", entry.nCountWithAncestors));
+            info.push_back(Pair("ancestorsize", entry.nSizeWithAncestors));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(entry.nFeesWithAncestors)));
+            info.push_back(Pair("descendantcount", entry.nCountWithDescendants));
+            info.push_back(Pair("descendantsize", entry.nSizeWithDescendants));
+            info.push_back(Pair("descendantfees", ValueFromAmount(entry.nFeesWithDescendants)));
+            Array depends;
+            BOOST_FOREACH(const uint256& hashDependsOn, entry.setDependsOn)
+                if (mempool.mapTx.count(hashDependsOn))
+                    depends.push_back(hashDependsOn.ToString());
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(hash.ToString(), info));
+        }
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -213,6 +247,54 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the memory pool size, its minimum fee rate, and for each stage of\n"
+            "transaction admission the transactions it handled, those it rejected,\n"
+            "the average time per transaction and the rate it can sustain.");
+
+    Object obj;
+    obj.push_back(Pair("size", (uint64_t)mempool.size()));
+    obj.push_back(Pair("bytes", mempool.GetTotalTxSize()));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFeePerKb())));
+
+    static const char* pszStageNames[ADMIT_STAGE_COUNT] = { "precheck", "inputs", "scripts", "insert" };
+    vector<CAdmissionStageStats> vStats;
+    GetAdmissionStats(vStats);
+    Object stages;
+    for (int i = 0; i < ADMIT_STAGE_COUNT; i++)
+    {
+        const CAdmissionStageStats& stats = vStats[i];
+        Object stage;
+        stage.push_back(Pair("count", stats.nCount));
+        stage.push_back(Pair("rejected", stats.nRejected));
+        stage.push_back(Pair("avgmicros", stats.nCount ? (double)stats.nTimeMicros / stats.nCount : 0.0));
+        stage.push_back(Pair("txpersec", stats.nTimeMicros ? stats.nCount * 1000000.0 / stats.nTimeMicros : 0.0));
+        stages.push_back(Pair(pszStageNames[i], stage));
+    }
+    obj.push_back(Pair("admission", stages));
+    return obj;
+}
+
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "Writes the memory pool to mempool.dat in the data directory.");
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return Value::null;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -262,13 +344,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -313,11 +313,17 @@ Value getnettotals(const Array& params, bool fHelp)
         throw runtime_error(
             "getnettotals\n"
             "Returns information about network traffic, including bytes in, bytes out,\n"
-            "and current time.");
+            "how long received messages waited to be processed, and current time.");
+
+    uint64_t nMessages;
+    int64_t nMessageWait;
+    CNode::GetTotalMessageWait(nMessages, nMessageWait);
 
     Object obj;
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("totalmessages", nMessages));
+    obj.push_back(Pair("avgmessagewaitmicros", nMessages ? nMessageWait / (int64_t)nMessages : 0));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
     return obj;
 }
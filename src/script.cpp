@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -2129,56 +2127,89 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are 32-byte digests of (signature hash, signature, public key),
+// salted with a per-process secret so that nobody can predict where an entry
+// lands or craft colliding entries. The digests are kept in fixed-size
+// tables of 4-way buckets, split over shards with a lock each, so lookups
+// from the script check threads rarely wait on each other and the memory
+// used is set by -sigcachesize up front.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int nShards = 16;
+    static const unsigned int nWays = 4;
+
+    struct Shard
+    {
+        boost::shared_mutex cs;
+        std::vector<uint256> vEntries; // nBuckets * nWays, zero = empty
+    };
+
+    Shard shards[nShards];
+    size_t nBuckets; // per shard
+    CSHA256 hasherSalted; // already holds one block of salt
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 entry;
+        CSHA256(hasherSalted).Write(hash.begin(), 32).Write(&vchSig[0], vchSig.size()).Write(pubKey.begin(), pubKey.size()).Finalize(entry.begin());
+        return entry;
+    }
 
 public:
+    CSignatureCache()
+    {
+        // Budget in megabytes, split evenly over the shards
+        int64_t nMaxCacheSizeMB = std::min(std::max(GetArg("-sigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), (int64_t)MAX_MAX_SIG_CACHE_SIZE);
+        nBuckets = (size_t)((nMaxCacheSizeMB << 20) / (sizeof(uint256) * nWays * nShards));
+        for (unsigned int i = 0; i < nShards; i++)
+            shards[i].vEntries.resize(nBuckets * nWays);
+
+        uint256 salt = GetRandHash();
+        unsigned char pad[32] = {0};
+        hasherSalted.Write(salt.begin(), 32).Write(pad, sizeof(pad));
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nBuckets == 0 || vchSig.empty())
+            return false;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        Shard& shard = shards[entry.Get64(0) % nShards];
+        const uint256* pbucket = &shard.vEntries[(entry.Get64(1) % nBuckets) * nWays];
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+        for (unsigned int i = 0; i < nWays; i++)
+            if (pbucket[i] == entry)
+                return true;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        if (nBuckets == 0 || vchSig.empty())
+            return;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        Shard& shard = shards[entry.Get64(0) % nShards];
+        uint256* pbucket = &shard.vEntries[(entry.Get64(1) % nBuckets) * nWays];
+
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+        for (unsigned int i = 0; i < nWays; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pbucket[i] == entry)
+                return;
+            if (pbucket[i] == 0)
+            {
+                pbucket[i] = entry;
+                return;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket full: evict a way picked by otherwise unused digest bits,
+        // which are as unpredictable to an attacker as the salt.
+        pbucket[entry.Get64(2) % nWays] = entry;
     }
 };
 
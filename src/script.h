@@ -28,6 +28,9 @@ class BaseSignatureChecker;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default and maximum size of the signature cache, in megabytes (-sigcachesize) */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 1024;
 
 template <typename T>
 std::vector<unsigned char> ToByteVector(const T& in)
@@ -0,0 +1,159 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+
+// Events returned by one epoll_wait; more stay queued for the next
+static const int MAX_EPOLL_EVENTS = 1024;
+#endif
+
+using namespace std;
+
+CSocketEvents::CSocketEvents(bool fUseEpoll)
+{
+#ifdef USE_EPOLL
+    hEpoll = fUseEpoll ? epoll_create(MAX_EPOLL_EVENTS) : -1;
+    if (fUseEpoll && hEpoll == -1)
+        LogPrintf("CSocketEvents() : epoll_create failed (%d), using select()\n", WSAGetLastError());
+    if (hEpoll != -1)
+        fcntl(hEpoll, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+}
+
+bool CSocketEvents::IsEdgeTriggered() const
+{
+#ifdef USE_EPOLL
+    return hEpoll != -1;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* pdata, bool fListen)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return true;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = fListen ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    event.data.ptr = pdata;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+        return error("CSocketEvents::Add() : epoll_ctl failed for socket %d: %d", (int)hSocket, WSAGetLastError());
+#endif
+    return true;
+}
+
+int CSocketEvents::Wait(const std::vector<CEvent>& vWanted, int nTimeoutMillis, std::vector<CEvent>& vReady)
+{
+    vReady.clear();
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nReady = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeoutMillis);
+        if (nReady < 0)
+        {
+            if (WSAGetLastError() == WSAEINTR)
+                return 0;
+            LogPrintf("socket epoll_wait error %d\n", WSAGetLastError());
+            MilliSleep(nTimeoutMillis);
+            return -1;
+        }
+        for (int i = 0; i < nReady; i++)
+        {
+            int nEvents = 0;
+            if (events[i].events & EPOLLIN)
+                nEvents |= SOCKET_RECV;
+            if (events[i].events & EPOLLOUT)
+                nEvents |= SOCKET_SEND;
+            if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                nEvents |= SOCKET_ERROR_EVENT;
+            vReady.push_back(CEvent(INVALID_SOCKET, events[i].data.ptr, nEvents));
+        }
+        return nReady;
+    }
+#endif
+    return WaitSelect(vWanted, nTimeoutMillis, vReady);
+}
+
+int CSocketEvents::WaitSelect(const std::vector<CEvent>& vWanted, int nTimeoutMillis, std::vector<CEvent>& vReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeoutMillis / 1000;
+    timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const CEvent& wanted, vWanted)
+    {
+#ifndef WIN32
+        if (wanted.hSocket >= FD_SETSIZE)
+            continue;
+#endif
+        FD_SET(wanted.hSocket, &fdsetError);
+        if (wanted.nEvents & SOCKET_RECV)
+            FD_SET(wanted.hSocket, &fdsetRecv);
+        if (wanted.nEvents & SOCKET_SEND)
+            FD_SET(wanted.hSocket, &fdsetSend);
+        hSocketMax = max(hSocketMax, wanted.hSocket);
+        have_fds = true;
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            // Try every socket for reading, the errors will show
+            LogPrintf("socket select error %d\n", WSAGetLastError());
+            BOOST_FOREACH(const CEvent& wanted, vWanted)
+                vReady.push_back(CEvent(wanted.hSocket, wanted.pdata, SOCKET_RECV));
+        }
+        MilliSleep(nTimeoutMillis);
+        return have_fds ? -1 : 0;
+    }
+
+    BOOST_FOREACH(const CEvent& wanted, vWanted)
+    {
+#ifndef WIN32
+        if (wanted.hSocket >= FD_SETSIZE)
+            continue;
+#endif
+        int nEvents = 0;
+        if (FD_ISSET(wanted.hSocket, &fdsetRecv))
+            nEvents |= SOCKET_RECV;
+        if (FD_ISSET(wanted.hSocket, &fdsetSend))
+            nEvents |= SOCKET_SEND;
+        if (FD_ISSET(wanted.hSocket, &fdsetError))
+            nEvents |= SOCKET_ERROR_EVENT;
+        if (nEvents)
+            vReady.push_back(CEvent(wanted.hSocket, wanted.pdata, nEvents));
+    }
+    return vReady.size();
+}
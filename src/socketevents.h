@@ -0,0 +1,65 @@
+// Copyright (c) 2020 The Rev project
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SOCKETEVENTS_H
+#define SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <vector>
+
+/** Waits for sockets to become ready, for ThreadSocketHandler.
+ *
+ * On Linux this is an edge-triggered epoll set: sockets are registered once
+ * with Add() and a wait returns only the ones that became readable or
+ * writable since, however many are registered. Callers remember readiness
+ * until a recv or send would block. Elsewhere, or if epoll is unavailable,
+ * it falls back to select() over the sockets passed to each Wait(), which
+ * reports them level-triggered and is limited to FD_SETSIZE.
+ */
+class CSocketEvents
+{
+public:
+    enum
+    {
+        SOCKET_RECV = 1,
+        SOCKET_SEND = 2,
+        SOCKET_ERROR_EVENT = 4,
+    };
+
+    struct CEvent
+    {
+        SOCKET hSocket;
+        void* pdata;
+        int nEvents;
+
+        CEvent(SOCKET hSocketIn, void* pdataIn, int nEventsIn) : hSocket(hSocketIn), pdata(pdataIn), nEvents(nEventsIn) {}
+    };
+
+private:
+#ifdef USE_EPOLL
+    int hEpoll;
+#endif
+
+    int WaitSelect(const std::vector<CEvent>& vWanted, int nTimeoutMillis, std::vector<CEvent>& vReady);
+
+public:
+    explicit CSocketEvents(bool fUseEpoll);
+    ~CSocketEvents();
+
+    /** Whether sockets are registered with Add() and reported edge-triggered */
+    bool IsEdgeTriggered() const;
+
+    /** Watch a socket for good; pdata comes back with its events. Listening
+     *  sockets are watched level-triggered, so one accept per wait is enough.
+     *  Closing the socket unregisters it. A no-op for select(). */
+    bool Add(SOCKET hSocket, void* pdata, bool fListen);
+
+    /** Wait up to nTimeoutMillis for sockets to become ready and return them
+     *  in vReady. vWanted, the sockets and events to wait for, is only used
+     *  by select(). Returns the number of ready sockets, or -1 on error. */
+    int Wait(const std::vector<CEvent>& vWanted, int nTimeoutMillis, std::vector<CEvent>& vReady);
+};
+
+#endif
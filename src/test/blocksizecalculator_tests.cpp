@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+#include "blocksizecalculator.h"
+
+using namespace std;
+
+// Links nLength blocks with random sizes on top of pindexFork.
+static void BuildChain(vector<CBlockIndex>& vBlocks, CBlockIndex* pindexFork, int nLength)
+{
+    vBlocks.resize(nLength);
+    CBlockIndex* pindexPrev = pindexFork;
+    for (int i = 0; i < nLength; i++)
+    {
+        CBlockIndex& block = vBlocks[i];
+        block.pprev = pindexPrev;
+        block.nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        block.nBlockSize = 1000 + GetRand(2000000);
+        pindexPrev = &block;
+    }
+}
+
+// Median of the window the straightforward way.
+static unsigned int SortedMedian(CBlockIndex* pindex, unsigned int nWindow)
+{
+    if (pindex->nHeight < (int)nWindow)
+        return 0;
+    vector<unsigned int> vSizes;
+    for (; pindex && vSizes.size() < nWindow; pindex = pindex->pprev)
+        vSizes.push_back(pindex->nBlockSize);
+    sort(vSizes.begin(), vSizes.end());
+    size_t n = vSizes.size();
+    if (n % 2 == 0)
+        return static_cast<unsigned int>(floor((vSizes[n / 2] + vSizes[n / 2 - 1]) / 2.0));
+    return vSizes[n / 2];
+}
+
+BOOST_AUTO_TEST_SUITE(blocksizecalculator_tests)
+
+BOOST_AUTO_TEST_CASE(median_block_size)
+{
+    LOCK(cs_main);
+    vector<CBlockIndex> vMain, vFork;
+    BuildChain(vMain, NULL, 200);
+    BuildChain(vFork, &vMain[150], 40);
+
+    // sliding forward one block at a time
+    for (int i = 0; i < 200; i++)
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(&vMain[i]), SortedMedian(&vMain[i], NUM_BLOCKS_FOR_MEDIAN_BLOCK));
+
+    // reorganizing onto the fork and back
+    for (int i = 0; i < 40; i++)
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(&vFork[i]), SortedMedian(&vFork[i], NUM_BLOCKS_FOR_MEDIAN_BLOCK));
+    BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(&vMain[199]), SortedMedian(&vMain[199], NUM_BLOCKS_FOR_MEDIAN_BLOCK));
+
+    // random jumps and an even window
+    for (int i = 0; i < 100; i++)
+    {
+        CBlockIndex* pindex = &vMain[GetRand(200)];
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex), SortedMedian(pindex, NUM_BLOCKS_FOR_MEDIAN_BLOCK));
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex, 10), SortedMedian(pindex, 10));
+    }
+
+    // below the toggle block the limit does not follow the median
+    BOOST_CHECK_EQUAL(BlockSizeCalculator::ComputeBlockSize(&vMain[199]), MIN_BLOCK_SIZE);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
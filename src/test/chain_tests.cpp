@@ -0,0 +1,136 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Builds a linked chain of nLength blocks on top of pindexFork (or a new
+// genesis block if it is NULL) in vBlocks.
+static void BuildChain(vector<CBlockIndex>& vBlocks, vector<uint256>& vHashes, CBlockIndex* pindexFork, int nLength, int nSalt)
+{
+    vBlocks.resize(nLength);
+    vHashes.resize(nLength);
+    CBlockIndex* pindexPrev = pindexFork;
+    for (int i = 0; i < nLength; i++)
+    {
+        CBlockIndex& block = vBlocks[i];
+        vHashes[i] = uint256(i + 1) + (uint256(nSalt) << 128);
+        block.phashBlock = &vHashes[i];
+        block.pprev = pindexPrev;
+        block.nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        if (pindexPrev)
+            pindexPrev->pnext = &block;
+        pindexPrev = &block;
+    }
+}
+
+// The pointer walk FindBlockByHeight used before the active chain vector.
+static CBlockIndex* WalkToHeight(CBlockIndex* pindexGenesis, CBlockIndex* pindexTip, int nHeight, CBlockIndex*& pindexLast)
+{
+    CBlockIndex* pblockindex = (nHeight < pindexTip->nHeight / 2) ? pindexGenesis : pindexTip;
+    if (pindexLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pindexLast->nHeight))
+        pblockindex = pindexLast;
+    while (pblockindex->nHeight > nHeight)
+        pblockindex = pblockindex->pprev;
+    while (pblockindex->nHeight < nHeight)
+        pblockindex = pblockindex->pnext;
+    pindexLast = pblockindex;
+    return pblockindex;
+}
+
+// The walk back from the tip the masternode GetBlockHash() used.
+static uint256 WalkBack(const CBlockIndex* pindexTip, int nBlocksAgo)
+{
+    const CBlockIndex* pindex = pindexTip;
+    for (int n = 0; n < nBlocksAgo; n++)
+        pindex = pindex->pprev;
+    return pindex->GetBlockHash();
+}
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(chain_settip)
+{
+    vector<CBlockIndex> vMain, vFork;
+    vector<uint256> vMainHashes, vForkHashes;
+    BuildChain(vMain, vMainHashes, NULL, 1000, 0);
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK(chain.Height() == -1);
+
+    chain.SetTip(&vMain.back());
+    BOOST_CHECK(chain.Height() == 999);
+    BOOST_CHECK(chain.Tip() == &vMain.back());
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK(chain[i] == &vMain[i]);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain[1000] == NULL);
+
+    // reorganize onto a longer branch forking off at height 900
+    BuildChain(vFork, vForkHashes, &vMain[900], 150, 1);
+    chain.SetTip(&vFork.back());
+    BOOST_CHECK(chain.Height() == 1050);
+    BOOST_CHECK(chain[900] == &vMain[900]);
+    BOOST_CHECK(chain[901] == &vFork[0]);
+    BOOST_CHECK(chain[1050] == &vFork.back());
+    BOOST_CHECK(chain.Contains(&vMain[500]));
+    BOOST_CHECK(!chain.Contains(&vMain[950]));
+
+    // and back onto a shorter one
+    chain.SetTip(&vMain[950]);
+    BOOST_CHECK(chain.Height() == 950);
+    BOOST_CHECK(chain[901] == &vMain[901]);
+    BOOST_CHECK(chain[951] == NULL);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+}
+
+// Microbenchmark of the height lookups behind getblockhash/getblockbynumber
+// and the masternode GetBlockHash(): the old pointer walks against the
+// active chain vector.
+BOOST_AUTO_TEST_CASE(chain_lookup_bench)
+{
+    const int nBlocks = 200000;
+    const int nLookups = 20000;
+    vector<CBlockIndex> vMain;
+    vector<uint256> vMainHashes;
+    BuildChain(vMain, vMainHashes, NULL, nBlocks, 0);
+    CBlockIndex* pindexTip = &vMain.back();
+
+    CChain chain;
+    chain.SetTip(pindexTip);
+
+    vector<int> vHeights(nLookups);
+    for (int i = 0; i < nLookups; i++)
+        vHeights[i] = GetRand(nBlocks);
+
+    // RPC: random heights
+    bool fSame = true;
+    CBlockIndex* pindexLast = NULL;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        fSame &= (WalkToHeight(&vMain[0], pindexTip, vHeights[i], pindexLast) == &vMain[vHeights[i]]);
+    int64_t nWalk = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        fSame &= (chain[vHeights[i]] == &vMain[vHeights[i]]);
+    int64_t nVector = GetTimeMicros();
+    BOOST_CHECK(fSame);
+    BOOST_TEST_MESSAGE(strprintf("height lookup, %d random heights: walk %.3fs, vector %.3fs",
+        nLookups, (nWalk - nStart) * 0.000001, (nVector - nWalk) * 0.000001));
+
+    // Masternode scoring: hashes a few thousand blocks below the tip
+    uint256 hashCheck = 0;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        hashCheck ^= WalkBack(pindexTip, vHeights[i] % 5000);
+    nWalk = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        hashCheck ^= chain[chain.Height() - vHeights[i] % 5000]->GetBlockHash();
+    nVector = GetTimeMicros();
+    BOOST_CHECK(hashCheck == 0);
+    BOOST_TEST_MESSAGE(strprintf("masternode block hash, %d lookups within 5000 blocks: walk %.3fs, vector %.3fs",
+        nLookups, (nWalk - nStart) * 0.000001, (nVector - nWalk) * 0.000001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
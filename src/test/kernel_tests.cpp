@@ -0,0 +1,113 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+// A wallet of nCoins eligible stake candidates with random outpoints and
+// values between 10 and 10000 coins.
+static void BuildWallet(vector<COutPoint>& vPrevouts, vector<CStakeCandidate>& vCandidates, int nCoins, unsigned int nTimeNow)
+{
+    vPrevouts.resize(nCoins);
+    vCandidates.resize(nCoins);
+    for (int i = 0; i < nCoins; i++)
+    {
+        vPrevouts[i] = COutPoint(GetRandHash(), GetRand(4));
+        CStakeCandidate& candidate = vCandidates[i];
+        candidate.fEligible = true;
+        candidate.nTimeTxPrev = nTimeNow - 100000 - GetRand(1000000);
+        candidate.nTimeBlockFrom = candidate.nTimeTxPrev;
+        candidate.nValue = (10 + GetRand(9990)) * COIN;
+    }
+}
+
+// The timestamp loop CreateCoinStake used before FindKernel().
+static bool SearchKernel(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeStart, unsigned int nCount, unsigned int nStep, const COutPoint& prevout, const CStakeCandidate& candidate, unsigned int& nTimeTxRet)
+{
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned int nTimeTx = nTimeStart - i * nStep;
+        if (CheckKernel(pindexPrev, nBits, nTimeTx, prevout, candidate))
+        {
+            nTimeTxRet = nTimeTx;
+            return true;
+        }
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// Synthetic wallets searched the old way, one CheckStakeKernelHash() per
+// timestamp, and with FindKernel(). Both must agree on every hit; the
+// timings are reported.
+BOOST_AUTO_TEST_CASE(kernel_search_bench)
+{
+    const int nCoins = 2000;
+    const unsigned int nCount = 64;
+    const unsigned int nStep = STAKE_TIMESTAMP_MASK + 1;
+    unsigned int nTimeNow = GetTime() & ~STAKE_TIMESTAMP_MASK;
+
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 100000;
+    indexPrev.nTime = nTimeNow - 64;
+    indexPrev.bnStakeModifierV2 = GetRandHash();
+
+    // about one hit per 10000 hashes for an average coin
+    unsigned int nBits = (CBigNum(~uint256(0)) / 10000 / (5000 * COIN)).GetCompact();
+
+    vector<COutPoint> vPrevouts;
+    vector<CStakeCandidate> vCandidates;
+    BuildWallet(vPrevouts, vCandidates, nCoins, nTimeNow);
+
+    int nHits = 0;
+    bool fSame = true;
+    int64_t nLoopTime = 0, nBatchTime = 0;
+    for (int i = 0; i < nCoins; i++)
+    {
+        unsigned int nTimeLoop = 0, nTimeBatch = 0;
+        int64_t nStart = GetTimeMicros();
+        bool fLoop = SearchKernel(&indexPrev, nBits, nTimeNow, nCount, nStep, vPrevouts[i], vCandidates[i], nTimeLoop);
+        int64_t nMid = GetTimeMicros();
+        bool fBatch = FindKernel(&indexPrev, nBits, nTimeNow, nCount, nStep, vPrevouts[i], vCandidates[i], nTimeBatch);
+        int64_t nEnd = GetTimeMicros();
+        nLoopTime += nMid - nStart;
+        nBatchTime += nEnd - nMid;
+
+        fSame &= (fLoop == fBatch && nTimeLoop == nTimeBatch);
+        if (fBatch)
+            nHits++;
+    }
+    BOOST_CHECK(fSame);
+    BOOST_TEST_MESSAGE(strprintf("kernel search, %d coins x %u timestamps (%d hits): loop %.3fs, batched %.3fs",
+        nCoins, nCount, nHits, nLoopTime * 0.000001, nBatchTime * 0.000001));
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_edges)
+{
+    unsigned int nTimeNow = GetTime() & ~STAKE_TIMESTAMP_MASK;
+    CBlockIndex indexPrev;
+    indexPrev.bnStakeModifierV2 = GetRandHash();
+    COutPoint prevout(GetRandHash(), 0);
+    CStakeCandidate candidate;
+    candidate.nTimeTxPrev = candidate.nTimeBlockFrom = nTimeNow - 40;
+    candidate.nValue = COIN;
+    unsigned int nTimeTx = 0;
+
+    // ineligible coins never hit
+    unsigned int nBitsEasy = CBigNum(~uint256(0)).GetCompact();
+    BOOST_CHECK(!FindKernel(&indexPrev, nBitsEasy, nTimeNow, 4, 16, prevout, candidate, nTimeTx));
+
+    // a target beyond 256 bits accepts the first timestamp
+    candidate.fEligible = true;
+    BOOST_CHECK(FindKernel(&indexPrev, nBitsEasy, nTimeNow, 4, 16, prevout, candidate, nTimeTx));
+    BOOST_CHECK(nTimeTx == nTimeNow);
+
+    // nothing older than the previous transaction is tried
+    unsigned int nBitsHard = CBigNum(1).GetCompact();
+    BOOST_CHECK(!FindKernel(&indexPrev, nBitsHard, nTimeNow, 100, 16, prevout, candidate, nTimeTx));
+    BOOST_CHECK(!FindKernel(&indexPrev, nBitsEasy, nTimeNow - 48, 4, 16, prevout, candidate, nTimeTx));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// A transaction spending output 0 of hashPrev, with an entry paying nFee
+// for nSize bytes.
+static CTransaction AddTx(CTxMemPool& pool, const uint256& hashPrev, int64_t nFee, unsigned int nSize, bool fInPool)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = GetRand(COIN);
+
+    CTxMemPoolEntry entry;
+    entry.nFee = nFee;
+    entry.nTxSize = nSize;
+    entry.nTime = GetTime();
+    if (fInPool)
+        entry.setDependsOn.insert(hashPrev);
+    pool.addUnchecked(tx.GetHash(), tx, entry);
+    return tx;
+}
+
+extern uint64_t nOrphanTxSize;
+
+// An orphan spending a random outpoint, padded to about nSize bytes.
+static CTransaction RandomOrphan(unsigned int nSize)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig << vector<unsigned char>(nSize - 100, 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_package_totals)
+{
+    CTxMemPool pool;
+    CTransaction txParent = AddTx(pool, GetRandHash(), 1000, 200, false);
+    CTransaction txChild = AddTx(pool, txParent.GetHash(), 3000, 300, true);
+    CTransaction txGrandChild = AddTx(pool, txChild.GetHash(), 500, 100, true);
+
+    const CTxMemPoolEntry& parent = pool.mapEntry[txParent.GetHash()];
+    const CTxMemPoolEntry& child = pool.mapEntry[txChild.GetHash()];
+    const CTxMemPoolEntry& grandChild = pool.mapEntry[txGrandChild.GetHash()];
+    BOOST_CHECK_EQUAL(parent.nCountWithDescendants, 3U);
+    BOOST_CHECK_EQUAL(parent.nSizeWithDescendants, 600U);
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 4500);
+    BOOST_CHECK_EQUAL(grandChild.nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(grandChild.nFeesWithAncestors, 4500);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 600U);
+
+    // the parent gets mined: the rest of the package forgets about it
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(child.nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(grandChild.nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(grandChild.nSizeWithAncestors, 400U);
+    BOOST_CHECK_EQUAL(child.nFeesWithDescendants, 3500);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByTime.size(), 2U);
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+    BOOST_CHECK(pool.setByDescendantScore.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+    // fee rates 10, 20, ... 100 per byte, 1000 bytes each
+    vector<CTransaction> vtx;
+    for (int i = 1; i <= 10; i++)
+        vtx.push_back(AddTx(pool, GetRandHash(), i * 10000, 1000, false));
+    // a well paying child keeps the lowest paying parent in
+    CTransaction txChild = AddTx(pool, vtx[0].GetHash(), 500000, 1000, true);
+
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(), 0);
+    pool.TrimToSize(8000);
+    BOOST_CHECK(pool.GetTotalTxSize() <= 8000);
+    BOOST_CHECK(pool.exists(vtx[0].GetHash()));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+    BOOST_CHECK(!pool.exists(vtx[1].GetHash()));
+    BOOST_CHECK(!pool.exists(vtx[2].GetHash()));
+    BOOST_CHECK(!pool.exists(vtx[3].GetHash()));
+    BOOST_CHECK(pool.exists(vtx[4].GetHash()));
+
+    // what was evicted paid 40000 per kB at most
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(), 40000 + MIN_RELAY_TX_FEE);
+
+    // the package outbids everything else, and then goes as a whole
+    pool.TrimToSize(2000);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 2000U);
+    BOOST_CHECK(!pool.exists(vtx[9].GetHash()));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+    pool.TrimToSize(1500);
+    BOOST_CHECK(!pool.exists(vtx[0].GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(orphan_budget)
+{
+    LOCK(cs_main);
+    const uint64_t nPeerShare = DEFAULT_MAX_ORPHAN_TX_SIZE * 1000 / ORPHAN_TX_PEER_SHARE;
+
+    BOOST_CHECK(!AddOrphanTx(RandomOrphan(MAX_ORPHAN_TX_SIZE + 200), 1));
+
+    // a peer fills its share and no more
+    CTransaction tx = RandomOrphan(4000);
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(AddOrphanTx(tx, 1));
+    BOOST_CHECK(!AddOrphanTx(tx, 2));
+    while (AddOrphanTx(RandomOrphan(4000), 1))
+        ;
+    BOOST_CHECK(nOrphanTxSize <= nPeerShare);
+    BOOST_CHECK(nOrphanTxSize + nSize > nPeerShare);
+
+    // which leaves the others theirs
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK(AddOrphanTx(RandomOrphan(4000), 2));
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(nOrphanTxSize, 10 * nSize);
+
+    // the byte budget
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 3 * nSize), 7U);
+    BOOST_CHECK(nOrphanTxSize <= 3 * nSize);
+
+    // and expiry
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 3 * nSize), 3U);
+    BOOST_CHECK_EQUAL(nOrphanTxSize, 0U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
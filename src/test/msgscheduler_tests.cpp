@@ -0,0 +1,214 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "msgscheduler.h"
+#include "util.h"
+
+#include <map>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(msgscheduler_tests)
+
+BOOST_AUTO_TEST_CASE(msgscheduler_order)
+{
+    CMessageScheduler scheduler(60 * 60 * 1000, 50);
+    NodeId id;
+    bool fTrickle;
+
+    // the first call starts a pass
+    BOOST_CHECK(!scheduler.Next(id, fTrickle));
+    vector<NodeId> vNodes;
+    vNodes.push_back(1);
+    vNodes.push_back(2);
+    vNodes.push_back(3);
+    scheduler.StartFullPass(vNodes, 2);
+
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+    BOOST_CHECK(!fTrickle);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 2);
+    BOOST_CHECK(fTrickle);
+
+    // a busy peer is not handed out again, however often it is woken
+    scheduler.Wake(1);
+    scheduler.Wake(1);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 3);
+    scheduler.Done(1, false);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+    BOOST_CHECK(!fTrickle);
+
+    // peers left with work come back
+    scheduler.Done(1, true);
+    scheduler.Done(2, false);
+    scheduler.Done(3, false);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+}
+
+BOOST_AUTO_TEST_CASE(msgscheduler_busy_pass)
+{
+    CMessageScheduler scheduler(60 * 60 * 1000, 50);
+    NodeId id;
+    bool fTrickle;
+
+    BOOST_CHECK(!scheduler.Next(id, fTrickle));
+    scheduler.StartFullPass(vector<NodeId>(1, 1), -1);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+
+    // peer 1 is still busy when the next pass, which trickles to it, starts
+    vector<NodeId> vNodes;
+    vNodes.push_back(1);
+    vNodes.push_back(2);
+    scheduler.StartFullPass(vNodes, 1);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 2);
+    BOOST_CHECK(!fTrickle);
+
+    // it gets its turn, and the trickle, once done
+    scheduler.Done(1, false);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+    BOOST_CHECK(fTrickle);
+}
+
+BOOST_AUTO_TEST_CASE(msgscheduler_retry_later)
+{
+    CMessageScheduler scheduler(60 * 60 * 1000, 50);
+    NodeId id;
+    bool fTrickle;
+
+    BOOST_CHECK(!scheduler.Next(id, fTrickle));
+    scheduler.StartFullPass(vector<NodeId>(1, 1), -1);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+
+    // a peer that ran into a busy lock is not handed out again at once
+    int64_t nStart = GetTimeMillis();
+    scheduler.Done(1, false, true);
+    scheduler.Wake(2);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 2);
+    scheduler.Done(2, false);
+
+    // but once the retry delay is over
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 1);
+    BOOST_CHECK(GetTimeMillis() - nStart >= 50);
+    scheduler.Done(1, false);
+
+    // woken in the meantime, it goes at once
+    scheduler.Wake(2);
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    scheduler.Done(2, false, true);
+    scheduler.Wake(2);
+    nStart = GetTimeMillis();
+    BOOST_CHECK(scheduler.Next(id, fTrickle));
+    BOOST_CHECK_EQUAL(id, 2);
+    BOOST_CHECK(GetTimeMillis() - nStart < 50);
+}
+
+// Peers whose messages are numbered in the order they arrived
+struct CTestPeers
+{
+    boost::mutex mut;
+    map<NodeId, vector<int> > mapQueued;
+    map<NodeId, int> mapHandled;
+    set<NodeId> setActive;
+    unsigned int nMaxActive;
+    int nTotalHandled;
+    bool fFailed;
+
+    CTestPeers() : nMaxActive(0), nTotalHandled(0), fFailed(false) {}
+};
+
+static void HandlerThread(CMessageScheduler* pscheduler, CTestPeers* ppeers, int nPeers)
+{
+    while (true)
+    {
+        NodeId id;
+        bool fTrickle;
+        if (!pscheduler->Next(id, fTrickle))
+        {
+            vector<NodeId> vNodes;
+            for (int i = 0; i < nPeers; i++)
+                vNodes.push_back(i);
+            pscheduler->StartFullPass(vNodes, GetRand(nPeers));
+            continue;
+        }
+
+        vector<int> vMessages;
+        {
+            boost::lock_guard<boost::mutex> lock(ppeers->mut);
+            if (!ppeers->setActive.insert(id).second)
+                ppeers->fFailed = true;
+            ppeers->nMaxActive = max(ppeers->nMaxActive, (unsigned int)ppeers->setActive.size());
+            vMessages.swap(ppeers->mapQueued[id]);
+        }
+
+        MilliSleep(1);
+
+        boost::lock_guard<boost::mutex> lock(ppeers->mut);
+        BOOST_FOREACH(int n, vMessages)
+        {
+            if (n != ppeers->mapHandled[id])
+                ppeers->fFailed = true;
+            ppeers->mapHandled[id] = n + 1;
+            ppeers->nTotalHandled++;
+        }
+        ppeers->setActive.erase(id);
+        pscheduler->Done(id, false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgscheduler_stress)
+{
+    const int nPeers = 20;
+    const int nMessages = 200;
+    CMessageScheduler scheduler(5, 5);
+    CTestPeers peers;
+
+    boost::thread_group threads;
+    for (int i = 0; i < 8; i++)
+        threads.create_thread(boost::bind(&HandlerThread, &scheduler, &peers, nPeers));
+
+    for (int n = 0; n < nMessages; n++)
+    {
+        for (NodeId id = 0; id < nPeers; id++)
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(peers.mut);
+                peers.mapQueued[id].push_back(n);
+            }
+            scheduler.Wake(id);
+        }
+        if (n % 20 == 0)
+            MilliSleep(1);
+    }
+
+    int64_t nTimeout = GetTimeMillis() + 60 * 1000;
+    while (GetTimeMillis() < nTimeout)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(peers.mut);
+            if (peers.nTotalHandled == nPeers * nMessages)
+                break;
+        }
+        MilliSleep(10);
+    }
+    threads.interrupt_all();
+    threads.join_all();
+
+    BOOST_CHECK_EQUAL(peers.nTotalHandled, nPeers * nMessages);
+    BOOST_CHECK(!peers.fFailed);
+    // different peers were handled at the same time
+    BOOST_CHECK(peers.nMaxActive > 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
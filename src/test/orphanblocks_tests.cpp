@@ -0,0 +1,178 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "orphanblocks.h"
+#include "util.h"
+#include "test/test_rev.h"
+
+using namespace std;
+
+// A chain of nLength blocks of about 1000 bytes on top of hashFork.
+static void BuildChain(vector<CBlock>& vBlocks, const uint256& hashFork, int nLength)
+{
+    vBlocks.resize(nLength);
+    uint256 hashPrev = hashFork;
+    for (int i = 0; i < nLength; i++)
+    {
+        CBlock& block = vBlocks[i];
+        block.hashPrevBlock = hashPrev;
+        block.nTime = GetTime() + i;
+        block.nNonce = GetRand(1000000000);
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig << vector<unsigned char>(900, i);
+        tx.vout.resize(1);
+        block.vtx.push_back(tx);
+        hashPrev = block.GetHash();
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(orphanblocks_tests, TestDataDirSetup)
+
+BOOST_AUTO_TEST_CASE(orphanblocks_spill_and_connect)
+{
+    COrphanBlockStore store;
+    store.SetLimits(100, 3500, 1000000);
+
+    uint256 hashMissing = GetRandHash();
+    vector<CBlock> vChain;
+    BuildChain(vChain, hashMissing, 10);
+
+    // delivered backwards, the worst order
+    for (int i = 9; i >= 0; i--)
+        BOOST_CHECK(store.Add(vChain[i]));
+    BOOST_CHECK(!store.Add(vChain[5]));
+    BOOST_CHECK_EQUAL(store.size(), 10U);
+    BOOST_CHECK(store.GetMemoryUsage() <= 3500);
+    BOOST_CHECK(store.GetDiskUsage() > 0);
+    BOOST_CHECK(boost::filesystem::exists(GetDataDir() / "orphanblocks.dat"));
+
+    uint256 hashRoot = vChain[0].GetHash();
+    for (int i = 0; i < 10; i++)
+    {
+        BOOST_CHECK(store.GetRoot(vChain[i].GetHash()) == hashRoot);
+        BOOST_CHECK(store.GetWanted(vChain[i].GetHash()) == hashMissing);
+    }
+
+    // the parent arrives: everything comes back, parents first
+    vector<uint256> vConnected;
+    vector<uint256> vWorkQueue(1, hashMissing);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        vector<uint256> vChildren;
+        store.GetChildren(vWorkQueue[i], vChildren);
+        BOOST_FOREACH(const uint256& hashChild, vChildren)
+        {
+            CBlock block;
+            BOOST_CHECK(store.Take(hashChild, block));
+            BOOST_CHECK(block.GetHash() == hashChild);
+            vConnected.push_back(hashChild);
+            vWorkQueue.push_back(hashChild);
+        }
+    }
+    BOOST_CHECK_EQUAL(vConnected.size(), 10U);
+    for (unsigned int i = 0; i < vConnected.size(); i++)
+        BOOST_CHECK(vConnected[i] == vChain[i].GetHash());
+    BOOST_CHECK_EQUAL(store.size(), 0U);
+    BOOST_CHECK_EQUAL(store.GetMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), 0U);
+    BOOST_CHECK(!boost::filesystem::exists(GetDataDir() / "orphanblocks.dat"));
+}
+
+BOOST_AUTO_TEST_CASE(orphanblocks_compact)
+{
+    vector<CBlock> vChain;
+    BuildChain(vChain, GetRandHash(), 4);
+    uint64_t nBlockSize = ::GetSerializeSize(vChain[0], SER_DISK, CLIENT_VERSION);
+
+    // everything spills, room for three blocks on disk
+    COrphanBlockStore store;
+    store.SetLimits(100, 0, nBlockSize * 7 / 2);
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(store.Add(vChain[i]));
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), nBlockSize * 3);
+
+    // the hole in the middle is reused: the fourth block goes to disk too,
+    // and nothing is dropped
+    CBlock block;
+    BOOST_CHECK(store.Take(vChain[1].GetHash(), block));
+    BOOST_CHECK(store.Add(vChain[3]));
+    BOOST_CHECK_EQUAL(store.size(), 3U);
+    BOOST_CHECK_EQUAL(store.GetMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), nBlockSize * 3);
+
+    int anLeft[] = {0, 2, 3};
+    BOOST_FOREACH(int i, anLeft)
+    {
+        BOOST_CHECK(store.Take(vChain[i].GetHash(), block));
+        BOOST_CHECK(block.GetHash() == vChain[i].GetHash());
+    }
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(orphanblocks_limits)
+{
+    COrphanBlockStore store;
+    store.SetLimits(5, 1000000, 0);
+
+    // the count limit drops the tips of the chain
+    vector<CBlock> vChain;
+    BuildChain(vChain, GetRandHash(), 8);
+    for (int i = 0; i < 8; i++)
+        store.Add(vChain[i]);
+    BOOST_CHECK_EQUAL(store.size(), 5U);
+    BOOST_CHECK(store.Has(vChain[0].GetHash()));
+
+    // a fork off the chain goes with it
+    vector<CBlock> vFork;
+    BuildChain(vFork, vChain[0].GetHash(), 2);
+    store.SetLimits(100, 1000000, 0);
+    store.Add(vFork[0]);
+    store.Add(vFork[1]);
+    store.EraseDescendants(vChain[0].GetHash());
+    BOOST_CHECK(store.Has(vChain[0].GetHash()));
+    BOOST_CHECK(!store.Has(vChain[1].GetHash()));
+    BOOST_CHECK(!store.Has(vFork[1].GetHash()));
+
+    // with no disk budget, memory is made room in
+    store.Clear();
+    store.SetLimits(100, 3500, 0);
+    for (int i = 0; i < 8; i++)
+        store.Add(vChain[i]);
+    BOOST_CHECK(store.GetMemoryUsage() <= 3500);
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), 0U);
+    BOOST_CHECK(store.size() < 8);
+}
+
+BOOST_AUTO_TEST_CASE(orphanblocks_full_disk)
+{
+    // unrelated orphans, none building on another
+    vector<CBlock> vBlocks;
+    for (int i = 0; i < 9; i++)
+    {
+        vector<CBlock> vChain;
+        BuildChain(vChain, GetRandHash(), 1);
+        vBlocks.push_back(vChain[0]);
+    }
+    uint64_t nBlockSize = ::GetSerializeSize(vBlocks[0], SER_DISK, CLIENT_VERSION);
+
+    // two blocks fit in memory and two on disk; after that only blocks in
+    // memory make room, the spilled ones stay
+    COrphanBlockStore store;
+    store.SetLimits(100, nBlockSize * 5 / 2, nBlockSize * 5 / 2);
+    for (int i = 0; i < 8; i++)
+        BOOST_CHECK(store.Add(vBlocks[i]));
+    BOOST_CHECK_EQUAL(store.size(), 4U);
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), nBlockSize * 2);
+    BOOST_CHECK_EQUAL(store.GetMemoryUsage(), nBlockSize * 2);
+    BOOST_CHECK(store.Has(vBlocks[7].GetHash()));
+
+    // once no block is left in memory, the new one is kept all the same
+    store.SetLimits(100, 0, nBlockSize * 5 / 2);
+    BOOST_CHECK(store.Add(vBlocks[8]));
+    BOOST_CHECK_EQUAL(store.size(), 3U);
+    BOOST_CHECK_EQUAL(store.GetDiskUsage(), nBlockSize * 2);
+    BOOST_CHECK(store.Has(vBlocks[8].GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include "relaycache.h"
+
+using namespace std;
+
+// A message of about nSize bytes
+static CSharedMessage MakeTestMessage(size_t nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.resize(nSize - CMessageHeader::HEADER_SIZE);
+    return MakeSharedMessage("tx", ss);
+}
+
+BOOST_AUTO_TEST_SUITE(relaycache_tests)
+
+BOOST_AUTO_TEST_CASE(relaycache_lru)
+{
+    CRelayCache cache;
+    cache.SetMaxBytes(3500);
+
+    vector<CInv> vInv;
+    for (int i = 0; i < 4; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    CSharedMessage msg0 = MakeTestMessage(1000);
+    cache.Put(vInv[0], msg0);
+    cache.Put(vInv[1], MakeTestMessage(1000));
+    cache.Put(vInv[2], MakeTestMessage(1000));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 3000U);
+
+    // every lookup hands out the same buffer
+    CSharedMessage msg;
+    BOOST_CHECK(cache.Get(vInv[0], msg));
+    BOOST_CHECK(msg == msg0);
+
+    // the least recently used goes first
+    cache.Put(vInv[3], MakeTestMessage(1000));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK(cache.Get(vInv[0], msg));
+    BOOST_CHECK(!cache.Get(vInv[1], msg));
+    BOOST_CHECK(cache.Get(vInv[2], msg));
+    BOOST_CHECK(cache.Get(vInv[3], msg));
+
+    // storing again replaces
+    cache.Put(vInv[0], MakeTestMessage(500));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 2500U);
+
+    // too big to keep at all
+    cache.Put(vInv[1], MakeTestMessage(4000));
+    BOOST_CHECK(!cache.Get(vInv[1], msg));
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 2500U);
+
+    // a smaller budget drops the oldest; vInv[2] was used least recently
+    cache.SetMaxBytes(1500);
+    BOOST_CHECK(!cache.Get(vInv[2], msg));
+    BOOST_CHECK(cache.Get(vInv[0], msg));
+    BOOST_CHECK(cache.Get(vInv[3], msg));
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 1500U);
+
+    cache.Erase(vInv[0]);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,85 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+
+#include <string>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sharedmessage_tests)
+
+BOOST_AUTO_TEST_CASE(sharedmessage_format)
+{
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << string("payload") << 1234;
+    CSharedMessage msg = MakeSharedMessage("test", ssPayload);
+
+    // the same bytes PushMessage would have queued
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("test", 0) << string("payload") << 1234;
+    FinishMessage(ss);
+    BOOST_CHECK(string(msg->begin(), msg->end()) == string(ss.begin(), ss.end()));
+
+    CMessageHeader hdr;
+    CDataStream ssHeader(msg->begin(), msg->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "test");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, (unsigned int)ssPayload.size());
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(sharedmessage_send)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    int nBufSize = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &nBufSize, sizeof(nBufSize));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+    // Queue more than fits into the socket buffer, each message once
+    // through PushMessage and once shared
+    CNode node(sv[0], CAddress(), "test", true);
+    string strExpected;
+    vector<CSharedMessage> vShared;
+    for (int i = 0; i < 100; i++)
+    {
+        vector<unsigned char> vch(1 + i * 97 % 3000, (unsigned char)i);
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << vch;
+        CSharedMessage msg = MakeSharedMessage("test", ss);
+        vShared.push_back(msg);
+        node.PushMessage("test", vch);
+        node.PushSharedMessage(msg);
+        strExpected.append(msg->begin(), msg->end());
+        strExpected.append(msg->begin(), msg->end());
+    }
+    BOOST_CHECK(!node.vSendMsg.empty());
+    BOOST_CHECK(vShared[99].use_count() > 1);
+
+    string strReceived;
+    char buf[16384];
+    for (int nTries = 0; nTries < 10000 && strReceived.size() < strExpected.size(); nTries++)
+    {
+        int nBytes;
+        while ((nBytes = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            strReceived.append(buf, nBytes);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    BOOST_CHECK(strReceived == strExpected);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+
+    // sent buffers are let go of
+    BOOST_CHECK_EQUAL(vShared[99].use_count(), 1);
+    close(sv[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+#include <boost/test/unit_test.hpp>
+
+#include "socketevents.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+#ifndef WIN32
+
+// nPeers loopback TCP connections; vServer holds our end of each
+static void ConnectPeers(int nPeers, vector<SOCKET>& vClient, vector<SOCKET>& vServer)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    BOOST_REQUIRE(listen(hListen, SOMAXCONN) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&addr, &len) == 0);
+
+    for (int i = 0; i < nPeers; i++)
+    {
+        SOCKET hClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        BOOST_REQUIRE(connect(hClient, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+        SOCKET hServer = accept(hListen, NULL, NULL);
+        BOOST_REQUIRE(hServer != INVALID_SOCKET);
+        fcntl(hServer, F_SETFL, O_NONBLOCK);
+        vClient.push_back(hClient);
+        vServer.push_back(hServer);
+    }
+    closesocket(hListen);
+}
+
+static void ClosePeers(vector<SOCKET>& vClient, vector<SOCKET>& vServer)
+{
+    for (unsigned int i = 0; i < vClient.size(); i++)
+    {
+        closesocket(vClient[i]);
+        closesocket(vServer[i]);
+    }
+}
+
+// Server sockets reported readable, as indexes into vServer
+static set<size_t> WaitReadable(CSocketEvents& events, const vector<SOCKET>& vServer, int nTimeoutMillis)
+{
+    vector<CSocketEvents::CEvent> vWanted, vReady;
+    if (!events.IsEdgeTriggered())
+        for (size_t i = 0; i < vServer.size(); i++)
+            vWanted.push_back(CSocketEvents::CEvent(vServer[i], (void*)(i + 1), CSocketEvents::SOCKET_RECV));
+    events.Wait(vWanted, nTimeoutMillis, vReady);
+    set<size_t> setReady;
+    BOOST_FOREACH(const CSocketEvents::CEvent& ready, vReady)
+        if (ready.nEvents & CSocketEvents::SOCKET_RECV)
+            setReady.insert((size_t)ready.pdata - 1);
+    return setReady;
+}
+
+static void CheckReadiness(bool fUseEpoll)
+{
+    vector<SOCKET> vClient, vServer;
+    ConnectPeers(64, vClient, vServer);
+    CSocketEvents events(fUseEpoll);
+    for (size_t i = 0; i < vServer.size(); i++)
+        BOOST_CHECK(events.Add(vServer[i], (void*)(i + 1), false));
+
+    BOOST_CHECK(WaitReadable(events, vServer, 0).empty());
+
+    set<size_t> setSent;
+    for (size_t i = 0; i < vClient.size(); i += 7)
+    {
+        BOOST_CHECK(send(vClient[i], "x", 1, 0) == 1);
+        setSent.insert(i);
+    }
+    MilliSleep(50);
+    set<size_t> setReady = WaitReadable(events, vServer, 1000);
+    BOOST_CHECK(setReady == setSent);
+
+    // Once read, a socket is quiet until more data comes
+    char ch;
+    BOOST_FOREACH(size_t i, setReady)
+        BOOST_CHECK(recv(vServer[i], &ch, 1, 0) == 1);
+    BOOST_CHECK(WaitReadable(events, vServer, 0).empty());
+
+    ClosePeers(vClient, vServer);
+}
+
+// One of nPeers sends a byte at a time; every wakeup reports just that one.
+// Returns microseconds per wakeup.
+static double CheckWakeups(bool fUseEpoll, int nPeers, int nRounds)
+{
+    vector<SOCKET> vClient, vServer;
+    ConnectPeers(nPeers, vClient, vServer);
+    CSocketEvents events(fUseEpoll);
+    for (size_t i = 0; i < vServer.size(); i++)
+        BOOST_CHECK(events.Add(vServer[i], (void*)(i + 1), false));
+    BOOST_CHECK(WaitReadable(events, vServer, 0).empty());
+
+    char ch;
+    int nWoken = 0;
+    int64_t nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+    {
+        size_t i = (n * 7919) % vClient.size();
+        BOOST_REQUIRE(send(vClient[i], "x", 1, 0) == 1);
+        set<size_t> setReady = WaitReadable(events, vServer, 1000);
+        if (setReady.size() == 1 && setReady.count(i))
+            nWoken++;
+        BOOST_REQUIRE(recv(vServer[i], &ch, 1, 0) == 1);
+    }
+    int64_t nTime = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nWoken, nRounds);
+    BOOST_CHECK(WaitReadable(events, vServer, 0).empty());
+
+    ClosePeers(vClient, vServer);
+    return (double)nTime / nRounds;
+}
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+BOOST_AUTO_TEST_CASE(socketevents_select)
+{
+    CheckReadiness(false);
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(socketevents_epoll)
+{
+    CSocketEvents events(true);
+    BOOST_CHECK(events.IsEdgeTriggered());
+    CheckReadiness(true);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(socketevents_wakeups)
+{
+    CheckWakeups(false, 64, 200);
+#ifdef USE_EPOLL
+    CheckWakeups(true, 64, 200);
+#endif
+}
+
+// Hundreds of mostly idle peers, as on a busy node. Run with
+// --log_level=message for the timings.
+BOOST_AUTO_TEST_CASE(socketevents_loopback_benchmark)
+{
+    const int nPeers = 400;
+    const int nRounds = 2000;
+    double dSelect = CheckWakeups(false, nPeers, nRounds);
+    BOOST_TEST_MESSAGE(strprintf("%d loopback peers, select(): %.1fus per wakeup", nPeers, dSelect));
+#ifdef USE_EPOLL
+    double dEpoll = CheckWakeups(true, nPeers, nRounds);
+    BOOST_TEST_MESSAGE(strprintf("%d loopback peers, epoll: %.1fus per wakeup", nPeers, dEpoll));
+#endif
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif
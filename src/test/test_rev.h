@@ -0,0 +1,22 @@
+#ifndef TEST_REV_H
+#define TEST_REV_H
+
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/** Fixture for tests that need a data directory: points -datadir at a fresh
+ *  temporary directory, the same one for the whole test run. */
+struct TestDataDirSetup
+{
+    TestDataDirSetup()
+    {
+        if (mapArgs.count("-datadir"))
+            return;
+        boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_rev_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+    }
+};
+
+#endif
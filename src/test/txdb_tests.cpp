@@ -0,0 +1,114 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "test/test_rev.h"
+
+using namespace std;
+
+// Exposes the raw key/value accessors of CTxDB to the tests.
+class CTxDBTester : public CTxDB
+{
+public:
+    CTxDBTester() : CTxDB("cr+") {}
+
+    bool WriteInt(int nKey, int nValue) { return Write(make_pair(string("test"), nKey), nValue); }
+    bool ReadInt(int nKey, int& nValue) { return Read(make_pair(string("test"), nKey), nValue); }
+    bool EraseInt(int nKey) { return Erase(make_pair(string("test"), nKey)); }
+    bool ExistsInt(int nKey) { return Exists(make_pair(string("test"), nKey)); }
+};
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, TestDataDirSetup)
+
+BOOST_AUTO_TEST_CASE(txdb_batch_overlay)
+{
+    CTxDBTester txdb;
+    int nValue = 0;
+
+    BOOST_CHECK(txdb.WriteInt(1, 100));
+    BOOST_CHECK(txdb.WriteInt(2, 200));
+
+    BOOST_CHECK(txdb.TxnBegin());
+    // reads see queued writes, the latest one winning
+    BOOST_CHECK(txdb.WriteInt(1, 101));
+    BOOST_CHECK(txdb.WriteInt(1, 102));
+    BOOST_CHECK(txdb.ReadInt(1, nValue) && nValue == 102);
+    // queued deletes hide records that are still on disk
+    BOOST_CHECK(txdb.EraseInt(2));
+    BOOST_CHECK(!txdb.ReadInt(2, nValue));
+    BOOST_CHECK(!txdb.ExistsInt(2));
+    // a write after a delete brings the key back
+    BOOST_CHECK(txdb.WriteInt(2, 202));
+    BOOST_CHECK(txdb.ReadInt(2, nValue) && nValue == 202);
+    BOOST_CHECK(txdb.ExistsInt(2));
+    BOOST_CHECK(txdb.TxnAbort());
+
+    // aborted changes are gone
+    BOOST_CHECK(txdb.ReadInt(1, nValue) && nValue == 100);
+    BOOST_CHECK(txdb.ReadInt(2, nValue) && nValue == 200);
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.EraseInt(1));
+    BOOST_CHECK(txdb.WriteInt(3, 300));
+    BOOST_CHECK(txdb.TxnCommit());
+
+    BOOST_CHECK(!txdb.ReadInt(1, nValue));
+    BOOST_CHECK(txdb.ReadInt(3, nValue) && nValue == 300);
+}
+
+// Microbenchmark: reads inside a transaction holding tens of thousands of
+// queued writes. With a linear batch scan this took seconds; it should now
+// take about as long as the writes themselves.
+BOOST_AUTO_TEST_CASE(txdb_batch_overlay_bench)
+{
+    const int nEntries = 50000;
+    CTxDBTester txdb;
+
+    BOOST_CHECK(txdb.TxnBegin());
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nEntries; i++)
+        txdb.WriteInt(1000000 + i, i);
+    int64_t nWritten = GetTimeMicros();
+
+    bool fAllOk = true;
+    for (int i = 0; i < nEntries; i++)
+    {
+        int nValue = -1;
+        if (!txdb.ReadInt(1000000 + i, nValue) || nValue != i)
+            fAllOk = false;
+    }
+    int64_t nRead = GetTimeMicros();
+    BOOST_CHECK(fAllOk);
+    BOOST_CHECK(txdb.TxnAbort());
+
+    BOOST_TEST_MESSAGE(strprintf("txdb batch overlay: %d writes in %.3fs, %d reads in %.3fs",
+        nEntries, (nWritten - nStart) * 0.000001, nEntries, (nRead - nWritten) * 0.000001));
+}
+
+BOOST_AUTO_TEST_CASE(txdb_addrindex_range)
+{
+    CTxDB txdb("cr+");
+    uint160 addrA = 0x1234, addrB = 0x1235;
+    uint256 tx1 = 1, tx2 = 2, tx3 = 3;
+    vector<uint256> vtxhash;
+
+    // written out of height order, one of them twice
+    BOOST_CHECK(txdb.WriteAddrIndex(addrA, 300, tx3));
+    BOOST_CHECK(txdb.WriteAddrIndex(addrA, 5, tx1));
+    BOOST_CHECK(txdb.WriteAddrIndex(addrB, 10, tx2));
+    BOOST_CHECK(txdb.WriteAddrIndex(addrA, 256, tx2));
+    BOOST_CHECK(txdb.WriteAddrIndex(addrA, 256, tx2));
+
+    BOOST_CHECK(txdb.ReadAddrIndex(addrA, vtxhash));
+    BOOST_CHECK(vtxhash.size() == 3);
+    BOOST_CHECK(vtxhash.size() == 3 && vtxhash[0] == tx1 && vtxhash[1] == tx2 && vtxhash[2] == tx3);
+
+    BOOST_CHECK(txdb.ReadAddrIndex(addrB, vtxhash));
+    BOOST_CHECK(vtxhash.size() == 1 && vtxhash[0] == tx2);
+
+    BOOST_CHECK(!txdb.ReadAddrIndex(uint160(0x1236), vtxhash));
+    BOOST_CHECK(vtxhash.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
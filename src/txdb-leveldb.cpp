@@ -3,7 +3,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <list>
 #include <map>
+#include <set>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
@@ -26,10 +28,217 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+/** In-memory cache of committed transaction index records, and of the
+ * transactions they point to, in front of LevelDB and the block files.
+ *
+ * Only state that is already committed to the database lives here. Records
+ * written inside a CTxDB transaction are held by that CTxDB until TxnCommit,
+ * so the cache is always consistent with hashBestChain on disk and never has
+ * to be flushed. Entries are evicted least recently used first once the
+ * estimated memory usage exceeds the budget.
+ */
+class CTxIndexCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        bool fHaveIndex;
+        CTxIndex txindex;
+        bool fHaveTx;
+        CTransaction tx;
+        size_t nUsage;
+    };
+    typedef std::list<CEntry> list_type;
+
+    mutable CCriticalSection cs;
+    list_type listEntries; // most recently used first
+    std::map<uint256, list_type::iterator> mapEntries;
+    size_t nUsage;
+    size_t nMaxUsage;
+    // Bumped on every write, so a reader that raced with a commit does not
+    // fill the cache with the record it read before the commit.
+    uint64_t nGeneration;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    static size_t EntryUsage(const CEntry& entry)
+    {
+        // Rough estimate: node overheads plus the heap payload of the record
+        // and of the transaction's scripts, which dominate.
+        size_t n = sizeof(CEntry) + 64;
+        n += entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+        if (entry.fHaveTx)
+            n += 2 * ::GetSerializeSize(entry.tx, SER_DISK, CLIENT_VERSION);
+        return n;
+    }
+
+    void Touch(list_type::iterator it)
+    {
+        listEntries.splice(listEntries.begin(), listEntries, it);
+    }
+
+    list_type::iterator Insert(const uint256& hash)
+    {
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi != mapEntries.end())
+        {
+            Touch(mi->second);
+            return mi->second;
+        }
+        listEntries.push_front(CEntry());
+        CEntry& entry = listEntries.front();
+        entry.hash = hash;
+        entry.fHaveIndex = false;
+        entry.fHaveTx = false;
+        entry.nUsage = 0;
+        mapEntries.insert(std::make_pair(hash, listEntries.begin()));
+        return listEntries.begin();
+    }
+
+    void Account(list_type::iterator it)
+    {
+        nUsage -= it->nUsage;
+        it->nUsage = EntryUsage(*it);
+        nUsage += it->nUsage;
+    }
+
+    void Remove(list_type::iterator it)
+    {
+        nUsage -= it->nUsage;
+        mapEntries.erase(it->hash);
+        listEntries.erase(it);
+    }
+
+    void Trim()
+    {
+        while (nUsage > nMaxUsage && !listEntries.empty())
+            Remove(--listEntries.end());
+    }
+
+public:
+    CTxIndexCache() : nUsage(0), nMaxUsage(0), nGeneration(0), nHits(0), nMisses(0) {}
+
+    void SetMaxUsage(size_t nMaxUsageIn)
+    {
+        LOCK(cs);
+        nMaxUsage = nMaxUsageIn;
+        Trim();
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        nGeneration++;
+        listEntries.clear();
+        mapEntries.clear();
+        nUsage = 0;
+    }
+
+    uint64_t GetGeneration() const
+    {
+        LOCK(cs);
+        return nGeneration;
+    }
+
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end() || !mi->second->fHaveIndex)
+        {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        Touch(mi->second);
+        txindex = mi->second->txindex;
+        return true;
+    }
+
+    // Store a record read from the database, unless a write happened since
+    // nReadGeneration was taken.
+    void FillTxIndex(const uint256& hash, const CTxIndex& txindex, uint64_t nReadGeneration)
+    {
+        LOCK(cs);
+        if (nMaxUsage == 0 || nReadGeneration != nGeneration)
+            return;
+        list_type::iterator it = Insert(hash);
+        it->fHaveIndex = true;
+        it->txindex = txindex;
+        Account(it);
+        Trim();
+    }
+
+    // Apply a record that has been committed to the database.
+    void SetTxIndex(const uint256& hash, const CTxIndex& txindex)
+    {
+        LOCK(cs);
+        nGeneration++;
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (nMaxUsage == 0)
+            return;
+        list_type::iterator it = (mi != mapEntries.end()) ? mi->second : Insert(hash);
+        it->fHaveIndex = true;
+        it->txindex = txindex;
+        Account(it);
+        Trim();
+    }
+
+    void EraseTxIndex(const uint256& hash)
+    {
+        LOCK(cs);
+        nGeneration++;
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi != mapEntries.end())
+            Remove(mi->second);
+    }
+
+    // Transactions are immutable, so a cached copy stays valid for as long as
+    // the record still points at the same place on disk.
+    bool GetTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end() || !mi->second->fHaveTx || mi->second->txindex.pos != pos)
+            return false;
+        Touch(mi->second);
+        tx = mi->second->tx;
+        return true;
+    }
+
+    void FillTx(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        // Only attach bodies to records we already hold, so the position
+        // check in GetTx always has a committed index to compare against.
+        if (mi == mapEntries.end() || !mi->second->fHaveIndex || mi->second->txindex.pos != pos)
+            return;
+        mi->second->fHaveTx = true;
+        mi->second->tx = tx;
+        Account(mi->second);
+        Trim();
+    }
+
+    void LogStats() const
+    {
+        LOCK(cs);
+        LogPrint("db", "CTxIndexCache: %u entries, %u/%u bytes, %u hits, %u misses\n",
+            mapEntries.size(), nUsage, nMaxUsage, nHits, nMisses);
+    }
+};
+
+static CTxIndexCache txindexcache;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 100);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // A quarter of -dbcache goes to the decoded transaction index cache, the
+    // rest to LevelDB's own block cache.
+    size_t nTxIndexCacheMB = nCacheSizeMB / 4;
+    txindexcache.SetMaxUsage(nTxIndexCacheMB * 1048576);
+    options.block_cache = leveldb::NewLRUCache((nCacheSizeMB - nTxIndexCacheMB) * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     return options;
 }
@@ -39,6 +248,7 @@ void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     filesystem::path directory = GetDataDir() / "txleveldb";
 
     if (fRemoveOld) {
+        txindexcache.Clear();
         filesystem::remove_all(directory); // remove directory
         unsigned int nFile = 1;
 
@@ -123,6 +333,8 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    txindexcache.LogStats();
+    txindexcache.Clear();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -131,6 +343,8 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchOverlay.clear();
+    mapPendingTxIndex.clear();
 }
 
 bool CTxDB::TxnBegin()
@@ -146,93 +360,189 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchOverlay.clear();
     if (!status.ok()) {
+        mapPendingTxIndex.clear();
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
-    return true;
-}
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
+    // The batch is on disk; publish its transaction index records.
+    for (map<uint256, pair<bool, CTxIndex> >::iterator mi = mapPendingTxIndex.begin(); mi != mapPendingTxIndex.end(); ++mi)
+    {
+        if (mi->second.first)
+            txindexcache.EraseTxIndex(mi->first);
+        else
+            txindexcache.SetTxIndex(mi->first, mi->second.second);
     }
-};
+    mapPendingTxIndex.clear();
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The overlay
+// mirrors the batch contents, so this is a single hash lookup rather than a
+// walk over every queued write.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    batch_overlay_type::const_iterator it = mapBatchOverlay.find(key.str());
+    if (it == mapBatchOverlay.end())
+        return false;
+    *deleted = it->second.first;
+    if (!*deleted)
+        *value = it->second.second;
+    return true;
+}
+
+bool CTxDB::WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash)
+{
+    // Writing the same record twice is harmless, so no read is needed here.
+    return Write(make_pair(string("adx"), CAddrIndexKey(addrHash, nHeight, txHash)), '\0');
+}
+
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+{
+    txHashes.clear();
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(string("adx"), addrHash);
+    string strPrefix = ssPrefix.str();
+
+    // A transaction touching the address through several outputs or inputs
+    // has one record per block it was indexed in; report it once.
+    set<uint256> setSeen;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(strPrefix); iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        CAddrIndexKey key;
+        ssKey >> strType >> key;
+        if (setSeen.insert(key.txHash).second)
+            txHashes.push_back(key.txHash);
     }
-    return scanner.foundEntry;
+    delete iterator;
+
+    return !txHashes.empty();
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+bool CTxDB::MigrateAddrIndex()
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << string("adr");
+    string strPrefix = ssStartKey.str();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    iterator->Seek(strPrefix);
+    if (!iterator->Valid() || !iterator->key().starts_with(strPrefix))
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        delete iterator;
+        return true;
     }
-    else
+
+    LogPrintf("Migrating address index to the (address, height, tx) layout...\n");
+    int64_t nStart = GetTimeMillis();
+
+    // The old records carry no height; recover it from the block the
+    // transaction was found in.
+    map<pair<unsigned int, unsigned int>, int> mapBlockHeight;
+    for (BlockMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        const CBlockIndex* pindex = (*mi).second;
+        if (pindex->IsInMainChain())
+            mapBlockHeight[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
     }
-}
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
-{
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    unsigned int nAddresses = 0, nRecords = 0;
+    if (!TxnBegin())
+    {
+        delete iterator;
+        return error("MigrateAddrIndex() : TxnBegin failed");
+    }
+    for (; iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+    {
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        uint160 addrHash;
+        vector<uint256> vtxhash;
+        ssKey >> strType >> addrHash;
+        ssValue >> vtxhash;
+
+        BOOST_FOREACH(const uint256& txHash, vtxhash)
+        {
+            int nHeight = 0;
+            CTxIndex txindex;
+            if (ReadTxIndex(txHash, txindex))
+            {
+                map<pair<unsigned int, unsigned int>, int>::const_iterator it =
+                    mapBlockHeight.find(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos));
+                if (it != mapBlockHeight.end())
+                    nHeight = (*it).second;
+            }
+            WriteAddrIndex(addrHash, nHeight, txHash);
+            nRecords++;
+        }
+        Erase(make_pair(string("adr"), addrHash));
+
+        // Keep the batch bounded on large indexes.
+        if (++nAddresses % 10000 == 0)
+        {
+            if (!TxnCommit() || !TxnBegin())
+            {
+                delete iterator;
+                return error("MigrateAddrIndex() : writing batch failed");
+            }
+        }
+    }
+    delete iterator;
+    if (!TxnCommit())
+        return error("MigrateAddrIndex() : TxnCommit failed");
+
+    LogPrintf("Migrated %u address index records for %u addresses in %dms\n", nRecords, nAddresses, GetTimeMillis() - nStart);
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (activeBatch)
+    {
+        // Records written in this transaction are not in the cache yet
+        map<uint256, pair<bool, CTxIndex> >::const_iterator mi = mapPendingTxIndex.find(hash);
+        if (mi != mapPendingTxIndex.end())
+        {
+            if (mi->second.first)
+                return false;
+            txindex = mi->second.second;
+            return true;
+        }
+    }
+    if (txindexcache.GetTxIndex(hash, txindex))
+        return true;
+
+    uint64_t nGeneration = txindexcache.GetGeneration();
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+    txindexcache.FillTxIndex(hash, txindex, nGeneration);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    if (activeBatch)
+        mapPendingTxIndex[hash] = make_pair(false, txindex);
+    else
+        txindexcache.SetTxIndex(hash, txindex);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -240,14 +550,20 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (!Erase(make_pair(string("tx"), hash)))
+        return false;
+    if (activeBatch)
+        mapPendingTxIndex[hash] = make_pair(true, CTxIndex());
+    else
+        txindexcache.EraseTxIndex(hash);
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
@@ -260,7 +576,17 @@ bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
     tx.SetNull();
     if (!ReadTxIndex(hash, txindex))
         return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    return ReadTxFromDisk(hash, txindex.pos, tx);
+}
+
+bool CTxDB::ReadTxFromDisk(uint256 hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    if (txindexcache.GetTx(hash, pos, tx))
+        return true;
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    txindexcache.FillTx(hash, pos, tx);
+    return true;
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -311,107 +637,462 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocateBlockIndex()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Construct the block index object for a "blockindex" record
+static CBlockIndex *InsertBlockIndexRecord(const uint256& hash, const CDiskBlockIndex& diskindex)
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+    CBlockIndex* pindexNew    = InsertBlockIndex(hash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nMint          = diskindex.nMint;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nFlags         = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+    pindexNew->prevoutStake   = diskindex.prevoutStake;
+    pindexNew->nStakeTime     = diskindex.nStakeTime;
+    pindexNew->hashProof      = diskindex.hashProof;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+
+    return pindexNew;
+}
+
+// A "blockindex" record as decoded by DecodeBlockIndexRecords.
+struct CBlockIndexRecord
+{
+    CDiskBlockIndex diskindex;
+    uint256 hashBlock;
+    uint256 nBlockTrust;
+};
+
+// Decode the raw records [nBegin, nEnd) of the values concatenated in strRaw.
+// Several of these run at once on disjoint ranges of vRecords.
+static void DecodeBlockIndexRecords(const std::string& strRaw, const std::vector<std::pair<size_t, size_t> >& vSpans,
+                                    std::vector<CBlockIndexRecord>& vRecords, size_t nBegin, size_t nEnd, char* pfOk)
+{
+    try
+    {
+        for (size_t i = nBegin; i < nEnd; i++)
+        {
+            const char* pbegin = strRaw.data() + vSpans[i].first;
+            CDataStream ssValue(pbegin, pbegin + vSpans[i].second, SER_DISK, CLIENT_VERSION);
+            CBlockIndexRecord& rec = vRecords[i];
+            ssValue >> rec.diskindex;
+            rec.hashBlock = rec.diskindex.GetBlockHash();
+            rec.nBlockTrust = rec.diskindex.GetBlockTrust();
+        }
+    }
+    catch (std::exception& e)
+    {
+        LogPrintf("DecodeBlockIndexRecords() : %s\n", e.what());
+        *pfOk = 0;
     }
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    //
+    // Loading runs in phases, each of which is timed:
+    //  1. read: one sequential scan copying the raw records into a single
+    //     buffer, so the iterator is released as early as possible;
+    //  2. decode: the records are deserialized, hashed and their block trust
+    //     computed by several threads, each on its own contiguous chunk;
+    //  3. link: the records are inserted into mapBlockIndex in scan order;
+    //  4. trust: chain trust is accumulated in a single pass over the blocks
+    //     bucketed by height.
+    int64_t nStart = GetTimeMillis();
+
+    std::string strRaw;
+    std::vector<std::pair<size_t, size_t> > vSpans;
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
+        leveldb::ReadOptions readOptions;
+        // One-shot scan, don't push the hot entries out of the block cache.
+        readOptions.fill_cache = false;
+        leveldb::Iterator *iterator = pdb->NewIterator(readOptions);
+        // Seek to start key.
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), uint256(0));
+        iterator->Seek(ssStartKey.str());
+        // The serialized type prefix every record key starts with.
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string("blockindex");
+        const std::string strPrefix = ssPrefix.str();
+        // Now read each entry.
+        for (; iterator->Valid(); iterator->Next())
+        {
+            // Did we reach the end of the data to read?
+            if (!iterator->key().starts_with(strPrefix))
+                break;
+            if (strRaw.size() + iterator->value().size() > strRaw.capacity())
+            {
+                boost::this_thread::interruption_point();
+                strRaw.reserve(std::max<size_t>(2 * strRaw.capacity(), 1 << 20));
+            }
+            vSpans.push_back(make_pair(strRaw.size(), iterator->value().size()));
+            strRaw.append(iterator->value().data(), iterator->value().size());
+        }
+        delete iterator;
+    }
+    int64_t nRead = GetTimeMillis();
+
+    boost::this_thread::interruption_point();
+
+    std::vector<CBlockIndexRecord> vRecords(vSpans.size());
+    {
+        // Small indexes are not worth starting threads for
+        const size_t nMinChunk = 10000;
+        size_t nThreads = std::max(1U, boost::thread::hardware_concurrency());
+        nThreads = std::min(nThreads, std::max<size_t>(1, vRecords.size() / nMinChunk));
+        nThreads = std::min<size_t>(nThreads, MAX_BLOCKINDEX_DECODE_THREADS);
+        size_t nChunk = (vRecords.size() + nThreads - 1) / nThreads;
+
+        std::vector<char> vfOk(nThreads, 1);
+        boost::thread_group decoders;
+        for (size_t t = 1; t < nThreads; t++)
+            decoders.create_thread(boost::bind(&DecodeBlockIndexRecords, boost::cref(strRaw), boost::cref(vSpans),
+                                               boost::ref(vRecords), std::min(t * nChunk, vRecords.size()),
+                                               std::min((t + 1) * nChunk, vRecords.size()), &vfOk[t]));
+        DecodeBlockIndexRecords(strRaw, vSpans, vRecords, 0, std::min(nChunk, vRecords.size()), &vfOk[0]);
+        decoders.join_all();
+
+        for (size_t t = 0; t < nThreads; t++)
+            if (!vfOk[t])
+                return error("LoadBlockIndex() : deserializing block index failed");
+        LogPrint("db", "LoadBlockIndex(): decoded %u entries on %u threads\n", vRecords.size(), nThreads);
+    }
+    // The raw records are no longer needed
+    std::string().swap(strRaw);
+    std::vector<std::pair<size_t, size_t> >().swap(vSpans);
+    int64_t nDecoded = GetTimeMillis();
+
+    boost::this_thread::interruption_point();
+
+    mapBlockIndex.rehash(vRecords.size());
+    int nMaxHeight = 0;
+    std::vector<CBlockIndex*> vIndex;
+    vIndex.reserve(vRecords.size());
+    for (size_t i = 0; i < vRecords.size(); i++)
+    {
+        const CBlockIndexRecord& rec = vRecords[i];
+        const CDiskBlockIndex& diskindex = rec.diskindex;
+        uint256 blockHash = rec.hashBlock;
+
+        // The chain trust pass below indexes by height
+        if (diskindex.nHeight < 0)
+            return error("LoadBlockIndex() : corrupt block index entry %s with height %d", blockHash.ToString(), diskindex.nHeight);
+
+        CBlockIndex* pindexNew = InsertBlockIndexRecord(blockHash, diskindex);
+        // Block trust was computed by the decoders; the chain trust pass
+        // below accumulates it.
+        pindexNew->nChainTrust = rec.nBlockTrust;
 
         // Watch for genesis block
         if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
             pindexGenesisBlock = pindexNew;
 
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
+        if (!pindexNew->CheckIndex())
             return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
         // NovaCoin: build setStakeSeen
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-        iterator->Next();
+        vIndex.push_back(pindexNew);
+        nMaxHeight = std::max(nMaxHeight, pindexNew->nHeight);
     }
-    delete iterator;
+    std::vector<CBlockIndexRecord>().swap(vRecords);
+    int64_t nLinked = GetTimeMillis();
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Calculate nChainTrust. A counting sort by height puts every block after
+    // its parent, so one pass adds up the trust of each chain.
+    std::vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
+        vHeightStart[pindex->nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    std::vector<CBlockIndex*> vSortedByHeight(vIndex.size());
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        vSortedByHeight[vHeightStart[pindex->nHeight]++] = pindex;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+    {
+        if (pindex->pprev)
+            pindex->nChainTrust += pindex->pprev->nChainTrust;
+    }
+    int64_t nTrust = GetTimeMillis();
+
+    LogPrintf("LoadBlockIndex(): %u entries, read %dms, decode %dms, link %dms, chain trust %dms\n",
+      vIndex.size(), nRead - nStart, nDecoded - nRead, nLinked - nDecoded, nTrust - nLinked);
+
+    return true;
+}
+
+//
+// Block index snapshot
+//
+// blockindex.snapshot holds the whole block index as it was at the last clean
+// shutdown, together with the chain trust of every block:
+//
+//   magic, network magic, version, hashBestChain, count,
+//   count * (block hash, chain trust, CDiskBlockIndex),
+//   double-SHA256 of everything before it
+//
+// It is deleted as soon as it has been read, so only a node that shut down
+// cleanly since ever finds one, and it is used only if hashBestChain still
+// matches the database.
+//
+
+static const std::string strSnapshotMagic = "blockindexsnapshot";
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blockindex.snapshot";
+}
+
+// Minimal read-only stream over a byte range, so the mapped snapshot is
+// decoded in place rather than copied into a CDataStream first.
+class CBufferReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CBufferReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    bool empty() const { return pcur == pend; }
+
+    CBufferReader& read(char* pch, size_t nSize)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+struct CBlockIndexSnapshotEntry
+{
+    uint256 hashBlock;
+    uint256 nChainTrust;
+    CDiskBlockIndex diskindex;
+};
+
+static bool ParseBlockIndexSnapshot(const char* pbegin, size_t nSize, const uint256& hashBestChainDB,
+                                    std::vector<CBlockIndexSnapshotEntry>& vEntries)
+{
+    if (nSize < sizeof(uint256))
+        return error("ParseBlockIndexSnapshot() : file too short");
+
+    // verify stored checksum matches input data
+    const char* pend = pbegin + nSize - sizeof(uint256);
+    uint256 hashIn;
+    memcpy(&hashIn, pend, sizeof(hashIn));
+    if (Hash(pbegin, pend) != hashIn)
+        return error("ParseBlockIndexSnapshot() : checksum mismatch; data corrupted");
+
+    try
+    {
+        CBufferReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+        std::string strMagic;
+        unsigned char pchMsgTmp[4];
+        int nSnapshotVersion;
+        uint256 hashBestChainIn;
+        unsigned int nCount;
+        reader >> strMagic >> FLATDATA(pchMsgTmp) >> nSnapshotVersion >> hashBestChainIn >> nCount;
+
+        if (strMagic != strSnapshotMagic || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("ParseBlockIndexSnapshot() : invalid magic number");
+        if (nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+            return error("ParseBlockIndexSnapshot() : unsupported version %d", nSnapshotVersion);
+        if (hashBestChainIn != hashBestChainDB)
+            return error("ParseBlockIndexSnapshot() : best chain %s does not match the database", hashBestChainIn.ToString());
+
+        // Don't trust nCount for more than the file could possibly hold
+        vEntries.reserve(std::min<size_t>(nCount, nSize / 100));
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            vEntries.push_back(CBlockIndexSnapshotEntry());
+            CBlockIndexSnapshotEntry& entry = vEntries.back();
+            reader >> entry.hashBlock >> entry.nChainTrust >> entry.diskindex;
+        }
+        if (!reader.empty())
+            return error("ParseBlockIndexSnapshot() : trailing data");
+    }
+    catch (std::exception &e)
+    {
+        return error("ParseBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(pathSnapshot))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    uint256 hashBestChainDB;
+    std::vector<CBlockIndexSnapshotEntry> vEntries;
+    bool fValid = ReadHashBestChain(hashBestChainDB);
+    if (fValid)
+    {
+        size_t nSize = boost::filesystem::file_size(pathSnapshot);
+#ifndef WIN32
+        int fd = open(pathSnapshot.string().c_str(), O_RDONLY);
+        void* pmap = (fd >= 0 && nSize > 0) ? mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (fd >= 0)
+            close(fd);
+        if (pmap == MAP_FAILED)
+            fValid = error("LoadBlockIndexSnapshot() : mapping %s failed", pathSnapshot.string());
+        else
+        {
+            posix_madvise(pmap, nSize, POSIX_MADV_SEQUENTIAL);
+            fValid = ParseBlockIndexSnapshot((const char*)pmap, nSize, hashBestChainDB, vEntries);
+            munmap(pmap, nSize);
+        }
+#else
+        std::vector<char> vchFile(nSize);
+        boost::filesystem::ifstream filein(pathSnapshot, std::ios_base::in | std::ios_base::binary);
+        if (nSize == 0 || !filein.read(&vchFile[0], nSize))
+            fValid = error("LoadBlockIndexSnapshot() : reading %s failed", pathSnapshot.string());
+        else
+            fValid = ParseBlockIndexSnapshot(&vchFile[0], nSize, hashBestChainDB, vEntries);
+#endif
+    }
+
+    // One use only: from here on the database moves ahead of the snapshot.
+    boost::filesystem::remove(pathSnapshot);
+    if (!fValid)
+    {
+        LogPrintf("LoadBlockIndexSnapshot() : snapshot not usable, loading the block index from the database\n");
+        return false;
+    }
+
+    mapBlockIndex.rehash(vEntries.size());
+    BOOST_FOREACH(const CBlockIndexSnapshotEntry& entry, vEntries)
+    {
+        CBlockIndex* pindexNew = InsertBlockIndexRecord(entry.hashBlock, entry.diskindex);
+        pindexNew->nChainTrust = entry.nChainTrust;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && entry.hashBlock == Params().HashGenesisBlock())
+            pindexGenesisBlock = pindexNew;
+
+        // NovaCoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+
+    LogPrintf("LoadBlockIndexSnapshot(): %u entries loaded from blockindex.snapshot in %dms\n",
+      vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = GetDataDir() / "blockindex.snapshot.new";
+
+    // open temp output file, and associate with CAutoFile
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    // Serialize in chunks, checksumming as we go, so the snapshot of a large
+    // index is never held in memory as a whole.
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    try
+    {
+        ss << strSnapshotMagic << FLATDATA(Params().MessageStart()) << BLOCKINDEX_SNAPSHOT_VERSION;
+        ss << hashBestChain << (unsigned int)mapBlockIndex.size();
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            ss << item.first << item.second->nChainTrust << CDiskBlockIndex(item.second);
+            if (ss.size() >= (1 << 20))
+            {
+                hasher.write(&ss[0], ss.size());
+                fileout.write(&ss[0], ss.size());
+                ss.clear();
+            }
+        }
+        if (!ss.empty())
+        {
+            hasher.write(&ss[0], ss.size());
+            fileout.write(&ss[0], ss.size());
+        }
+        fileout << hasher.GetHash();
+    }
+    catch (std::exception &e)
+    {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace existing blockindex.snapshot, if any
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    LogPrintf("Written %u block index entries to blockindex.snapshot  %dms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    // A snapshot written at the last clean shutdown spares us the scan of
+    // the "blockindex" records; if there is none, or it does not match the
+    // database, load the records themselves.
+    if (!(GetBoolArg("-blockindexsnapshot", false) && LoadBlockIndexSnapshot()))
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        if (!LoadBlockIndexGuts())
+            return false;
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -424,6 +1105,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -15,6 +15,41 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <boost/unordered_map.hpp>
+
+// Key of an address index record. Records are stored as
+// ("adx", addrHash, height, txHash) -> empty value, so indexing a transaction
+// is a single append and all transactions touching an address sit next to each
+// other in the database. The height is written big-endian so that LevelDB's
+// bytewise key order is also block height order.
+struct CAddrIndexKey
+{
+    uint160 addrHash;
+    unsigned int nHeight;
+    uint256 txHash;
+
+    CAddrIndexKey() : addrHash(0), nHeight(0), txHash(0) {}
+    CAddrIndexKey(const uint160& addrHashIn, unsigned int nHeightIn, const uint256& txHashIn) :
+        addrHash(addrHashIn), nHeight(nHeightIn), txHash(txHashIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addrHash);
+        unsigned char vchHeight[4];
+        for (int i = 0; i < 4; i++)
+            vchHeight[i] = (unsigned char)(nHeight >> (24 - 8 * i));
+        READWRITE(FLATDATA(vchHeight));
+        if (fRead)
+        {
+            unsigned int nHeightRead = 0;
+            for (int i = 0; i < 4; i++)
+                nHeightRead = (nHeightRead << 8) | vchHeight[i];
+            const_cast<CAddrIndexKey*>(this)->nHeight = nHeightRead;
+        }
+        READWRITE(txHash);
+    )
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -46,10 +81,23 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // Index of the writes and deletes queued in activeBatch, so reads inside
+    // a transaction don't have to walk the whole batch. Maps the serialized
+    // key to (deleted, value); later operations on a key replace earlier ones,
+    // matching the order in which the batch is applied.
+    typedef boost::unordered_map<std::string, std::pair<bool, std::string> > batch_overlay_type;
+    batch_overlay_type mapBatchOverlay;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
+    // Transaction index records written while activeBatch is open. They are
+    // handed to the shared transaction index cache only once the batch has
+    // been committed; an erased record is stored as (true, null index).
+    std::map<uint256, std::pair<bool, CTxIndex> > mapPendingTxIndex;
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
@@ -111,7 +159,11 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& entry = mapBatchOverlay[strKey];
+            entry.first = false;
+            entry.second = ssValue.str();
+            activeBatch->Put(strKey, entry.second);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +186,11 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& entry = mapBatchOverlay[strKey];
+            entry.first = true;
+            entry.second.clear();
+            activeBatch->Delete(strKey);
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,9 +207,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+            if (ScanBatch(ssKey, &unused, &deleted))
+                return !deleted;
         }
 
 
@@ -169,6 +224,8 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapBatchOverlay.clear();
+        mapPendingTxIndex.clear();
         return true;
     }
 
@@ -183,8 +240,12 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
+    // Returns the transactions touching addrHash in block height order.
+    // Only committed records are visible, not those queued in activeBatch.
     bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash);
+    // Converts records of the old ("adr", addrHash) -> vector<uint256> layout.
+    bool MigrateAddrIndex();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -194,14 +255,18 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadTxFromDisk(uint256 hash, const CDiskTxPos& pos, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
+    // Writes blockindex.snapshot from mapBlockIndex; call with cs_main held.
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
 };
 
 
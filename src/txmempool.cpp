@@ -9,8 +9,98 @@
 
 using namespace std;
 
-CTxMemPool::CTxMemPool()
+double CTxMemPoolEntry::GetPriority(int nHeight) const
 {
+    return ((double)nValueInChain * nHeight - dValueHeightInChain) / nTxSize;
+}
+
+double CTxMemPoolEntry::GetFeePerKb() const
+{
+    return double(nFee) / (double(nTxSize) / 1000.0);
+}
+
+CTxMemPool::CTxMemPool() : nTransactionsUpdated(0), nTotalTxSize(0), nRollingMinFeePerKb(0), nLastRollingFeeUpdate(0)
+{
+}
+
+// In-pool ancestors of entry, following setDependsOn
+void CTxMemPool::CalculateAncestors(const CTxMemPoolEntry& entry, set<uint256>& setAncestors) const
+{
+    vector<uint256> vToVisit(entry.setDependsOn.begin(), entry.setDependsOn.end());
+    while (!vToVisit.empty())
+    {
+        uint256 hash = vToVisit.back();
+        vToVisit.pop_back();
+        map<uint256, CTxMemPoolEntry>::const_iterator it = mapEntry.find(hash);
+        if (it == mapEntry.end() || !setAncestors.insert(hash).second)
+            continue;
+        vToVisit.insert(vToVisit.end(), it->second.setDependsOn.begin(), it->second.setDependsOn.end());
+    }
+}
+
+// In-pool descendants of hash, following mapNextTx
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vToVisit(1, hash);
+    while (!vToVisit.empty())
+    {
+        uint256 hashParent = vToVisit.back();
+        vToVisit.pop_back();
+        map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hashParent, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashParent; ++it)
+        {
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vToVisit.push_back(hashChild);
+        }
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash, int nCount, int64_t nSize, int64_t nFees)
+{
+    map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    if (it == mapEntry.end())
+        return;
+    CTxMemPoolEntry& entry = it->second;
+    entry.nCountWithAncestors += nCount;
+    entry.nSizeWithAncestors += nSize;
+    entry.nFeesWithAncestors += nFees;
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash, int nCount, int64_t nSize, int64_t nFees)
+{
+    map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    if (it == mapEntry.end())
+        return;
+    CTxMemPoolEntry& entry = it->second;
+    setByDescendantScore.erase(CTxMemPoolFeeKey(entry.nFeesWithDescendants, entry.nSizeWithDescendants, hash));
+    entry.nCountWithDescendants += nCount;
+    entry.nSizeWithDescendants += nSize;
+    entry.nFeesWithDescendants += nFees;
+    setByDescendantScore.insert(CTxMemPoolFeeKey(entry.nFeesWithDescendants, entry.nSizeWithDescendants, hash));
+}
+
+// Drops hash from mapEntry and the sorted views and takes it out of the
+// totals of the ancestors and descendants still in the pool
+void CTxMemPool::removeEntry(const uint256& hash)
+{
+    map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    if (it == mapEntry.end())
+        return;
+    const CTxMemPoolEntry& entry = it->second;
+
+    set<uint256> setAncestors, setDescendants;
+    CalculateAncestors(entry, setAncestors);
+    CalculateDescendants(hash, setDescendants);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        UpdateDescendantState(hashAncestor, -1, -(int64_t)entry.nTxSize, -entry.nFee);
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        UpdateAncestorState(hashDescendant, -1, -(int64_t)entry.nTxSize, -entry.nFee);
+
+    setByDescendantScore.erase(CTxMemPoolFeeKey(entry.nFeesWithDescendants, entry.nSizeWithDescendants, hash));
+    setByTime.erase(make_pair(entry.nTime, hash));
+    nTotalTxSize -= entry.nTxSize;
+    mapEntry.erase(it);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,7 +115,47 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::TrimToSize(uint64_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    int64_t nMaxEvictedFeePerKb = 0;
+    while (nTotalTxSize > nSizeLimit && !setByDescendantScore.empty())
+    {
+        const CTxMemPoolFeeKey& key = *setByDescendantScore.begin();
+        nMaxEvictedFeePerKb = max(nMaxEvictedFeePerKb, key.GetFeePerKb());
+        nEvicted += mapEntry[key.hash].nCountWithDescendants;
+        CTransaction tx = mapTx[key.hash];
+        remove(tx, true);
+    }
+
+    if (nEvicted > 0)
+    {
+        GetMinFeePerKb(); // decay up to now first
+        nRollingMinFeePerKb = max(nRollingMinFeePerKb, nMaxEvictedFeePerKb + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+        LogPrint("mempool", "TrimToSize : evicted %u transactions, min fee now %d per kB\n", nEvicted, nRollingMinFeePerKb);
+    }
+}
+
+int64_t CTxMemPool::GetMinFeePerKb()
+{
+    LOCK(cs);
+    if (nRollingMinFeePerKb == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate)
+    {
+        nRollingMinFeePerKb = (int64_t)(nRollingMinFeePerKb / pow(2.0, (double)(nNow - nLastRollingFeeUpdate) / ROLLING_FEE_HALFLIFE));
+        nLastRollingFeeUpdate = nNow;
+        if (nRollingMinFeePerKb < MIN_RELAY_TX_FEE / 2)
+            nRollingMinFeePerKb = 0;
+    }
+    return nRollingMinFeePerKb;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
@@ -36,6 +166,30 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+
+        // Its own totals start out as just itself; the ancestors it joins
+        // count it as a descendant. Nothing in the pool can spend it yet.
+        CTxMemPoolEntry& newEntry = mapEntry[hash] = entry;
+        newEntry.setDependsOn.clear();
+        BOOST_FOREACH(const uint256& hashDependsOn, entry.setDependsOn)
+            if (mapTx.count(hashDependsOn))
+                newEntry.setDependsOn.insert(hashDependsOn);
+        set<uint256> setAncestors;
+        CalculateAncestors(newEntry, setAncestors);
+        newEntry.nCountWithAncestors = newEntry.nCountWithDescendants = 1;
+        newEntry.nSizeWithAncestors = newEntry.nSizeWithDescendants = newEntry.nTxSize;
+        newEntry.nFeesWithAncestors = newEntry.nFeesWithDescendants = newEntry.nFee;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            const CTxMemPoolEntry& ancestor = mapEntry[hashAncestor];
+            newEntry.nCountWithAncestors++;
+            newEntry.nSizeWithAncestors += ancestor.nTxSize;
+            newEntry.nFeesWithAncestors += ancestor.nFee;
+            UpdateDescendantState(hashAncestor, 1, newEntry.nTxSize, newEntry.nFee);
+        }
+        setByDescendantScore.insert(CTxMemPoolFeeKey(newEntry.nFeesWithDescendants, newEntry.nSizeWithDescendants, hash));
+        setByTime.insert(make_pair(newEntry.nTime, hash));
+        nTotalTxSize += newEntry.nTxSize;
     }
     return true;
 }
@@ -55,6 +209,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                         remove(*it->second.ptx, true);
                 }
             }
+            removeEntry(hash);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
@@ -84,6 +239,10 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByDescendantScore.clear();
+    setByTime.clear();
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
@@ -7,6 +7,63 @@
 
 #include "chain.h"
 
+/** What the pool keeps about a transaction besides the transaction itself.
+ *  The per-transaction part is worked out once, from the inputs fetched when
+ *  the transaction is accepted, instead of on every block template. The
+ *  ancestor and descendant totals include the transaction itself and are
+ *  kept up to date by the pool as transactions come and go.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;                   // value in minus value out
+    unsigned int nTxSize;           // serialized size
+    unsigned int nSigOps;           // legacy and P2SH signature operations
+    int64_t nTime;                  // when it entered the pool
+    int64_t nValueInChain;          // value of the inputs that are in the chain
+    double dValueHeightInChain;     // sum of value * height over those inputs
+    std::set<uint256> setDependsOn; // pool transactions this one spends
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    CTxMemPoolEntry() : nFee(0), nTxSize(0), nSigOps(0), nTime(0), nValueInChain(0), dValueHeightInChain(0),
+        nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0),
+        nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0) {}
+
+    // sum(value in * confirmations) / size for a block at nHeight
+    double GetPriority(int nHeight) const;
+    // Fee per 1000 bytes, without the rounding up GetMinFee() does
+    double GetFeePerKb() const;
+};
+
+/** Key of a pool transaction in an index sorted by fee rate, lowest first.
+ *  Ties go by hash so that every transaction has its own key.
+ */
+class CTxMemPoolFeeKey
+{
+public:
+    int64_t nFees;
+    uint64_t nSize;
+    uint256 hash;
+
+    CTxMemPoolFeeKey(int64_t nFeesIn, uint64_t nSizeIn, const uint256& hashIn) : nFees(nFeesIn), nSize(nSizeIn), hash(hashIn) {}
+
+    int64_t GetFeePerKb() const { return nSize ? nFees * 1000 / (int64_t)nSize : 0; }
+
+    friend bool operator<(const CTxMemPoolFeeKey& a, const CTxMemPoolFeeKey& b)
+    {
+        double fa = (double)a.nFees * b.nSize, fb = (double)b.nFees * a.nSize;
+        if (fa != fb)
+            return fa < fb;
+        return a.hash < b.hash;
+    }
+};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -21,15 +78,34 @@ class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;
+
+    // Fee rate floor raised by evictions, so that what was just evicted is
+    // not taken straight back; it halves every ROLLING_FEE_HALFLIFE seconds
+    int64_t nRollingMinFeePerKb;
+    int64_t nLastRollingFeeUpdate;
+
+    void CalculateAncestors(const CTxMemPoolEntry& entry, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateAncestorState(const uint256& hash, int nCount, int64_t nSize, int64_t nFees);
+    void UpdateDescendantState(const uint256& hash, int nCount, int64_t nSize, int64_t nFees);
+    void removeEntry(const uint256& hash);
 
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+
+    // Sorted views of mapEntry
+    std::set<CTxMemPoolFeeKey> setByDescendantScore;  // fee rate with descendants, eviction order
+    std::set<std::pair<int64_t, uint256> > setByTime; // entry time, getrawmempool order
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -37,6 +113,19 @@ public:
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    // Evicts the transactions with the lowest fee rate, together with their
+    // descendants, until the pool's transactions take up at most nSizeLimit
+    // serialized bytes
+    void TrimToSize(uint64_t nSizeLimit);
+    // Fee per 1000 bytes new transactions must pay after evictions
+    int64_t GetMinFeePerKb();
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     unsigned long size() const
     {
         LOCK(cs);